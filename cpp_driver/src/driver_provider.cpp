@@ -29,6 +29,13 @@ EVRInitError DriverProvider::Init(IVRDriverContext* pDriverContext)
         return VRInitError_Init_InterfaceNotFound;
     }
 
+    // Load per-unit calibration (camera intrinsics, LED offsets) from the driver's resources folder
+    std::string calibrationPath = VRProperties()->GetStringProperty(
+        pDriverContext->GetDriverHandle(), Prop_InstallPath_String) + "\\resources\\calibration.json";
+    if (!vr_device_load_calibration(m_pRustDevice, calibrationPath.c_str())) {
+        printf("No calibration at %s, using defaults\n", calibrationPath.c_str());
+    }
+
     // Create HMD device
     m_pHmdDevice = new HMDDevice(m_pRustDevice);
 
@@ -0,0 +1,201 @@
+// Offline calibration tool.
+//
+// Reads sessions written by the record tool (one JSON line per IR packet, paired with the latest
+// IMU quaternion), assigns blobs to LEDs, refines the camera intrinsics, LED offsets and
+// IMU/camera rotations, and writes a versioned calibration file into the driver's resources
+// folder (steamvr_driver/resources/calibration.json, relative to the repository root), where
+// DriverProvider::Init loads it. The stored camera mounting is relative to the IMU heading during
+// the session; the driver estimates its own heading against it after every boot. All sessions
+// passed together must come from one boot. Session lines look like:
+//
+//   {"t":0.01,"w":1.0,"x":0.0,"y":0.0,"z":0.0,"ir":[{"x":512,"y":384,"s":7}, ...]}
+//
+// Blobs may carry an "id" (LED from led_constellation.json) in hand-labelled sessions; otherwise
+// the assignment is found by projecting the constellation under the current calibration.
+
+use std::{collections::HashMap, fs::File, io::{BufRead, BufReader}, path::PathBuf, process::ExitCode, time::Instant};
+
+use vr_driver::{
+    bundle_adjust::{self, Convergence, SolverOptions},
+    calibration::{self, Calibration, SessionFrame},
+    correspondence::{self, RecordedFrame},
+};
+
+struct Args {
+    constellation: PathBuf,
+    output: PathBuf,
+    initial: Option<PathBuf>,
+    threads: usize,
+    max_rms: f64,
+    force: bool,
+    sessions: Vec<PathBuf>,
+}
+
+const USAGE: &str = "Usage: calibrate [--constellation led_constellation.json] [--output steamvr_driver/resources/calibration.json] \
+                     [--initial calibration.json] [--threads N] [--max-rms 2.0] [--force] <session.jsonl>...";
+
+// Blob assignment thresholds (pixels): loose under the starting guess, tight once refined
+const LABEL_MAX_RMS: [f64; 2] = [15.0, 5.0];
+
+// A fit that only explains a minority of the frames is usually self-consistent but wrong
+const MIN_ASSIGNED_FRAMES: f64 = 0.5;
+
+fn parse_args() -> Result<Args, String> {
+    let mut args = Args {
+        constellation: PathBuf::from("led_constellation.json"),
+        output: PathBuf::from("steamvr_driver/resources/calibration.json"),
+        initial: None,
+        threads: 0,
+        max_rms: SolverOptions::default().max_rms,
+        force: false,
+        sessions: Vec::new(),
+    };
+
+    let mut iter = std::env::args().skip(1);
+    while let Some(arg) = iter.next() {
+        let mut value = || iter.next().ok_or(format!("Missing value for {arg}"));
+        match arg.as_str() {
+            "--constellation" => args.constellation = PathBuf::from(value()?),
+            "--output" | "-o" => args.output = PathBuf::from(value()?),
+            "--initial" => args.initial = Some(PathBuf::from(value()?)),
+            "--threads" => {
+                args.threads = value()?.parse().map_err(|e| format!("Invalid --threads: {e}"))?
+            }
+            "--max-rms" => {
+                args.max_rms = value()?.parse().map_err(|e| format!("Invalid --max-rms: {e}"))?
+            }
+            "--force" => args.force = true,
+            "--help" | "-h" => return Err(USAGE.to_string()),
+            _ => args.sessions.push(PathBuf::from(arg)),
+        }
+    }
+
+    if args.sessions.is_empty() {
+        return Err(USAGE.to_string());
+    }
+    Ok(args)
+}
+
+fn load_session(path: &PathBuf, led_index: &HashMap<u32, usize>, frames: &mut Vec<RecordedFrame>) -> Result<(), String> {
+    let file = File::open(path).map_err(|e| format!("Failed to open {}: {}", path.display(), e))?;
+
+    for line in BufReader::new(file).lines() {
+        let line = line.map_err(|e| format!("Failed to read {}: {}", path.display(), e))?;
+
+        // Skip partial lines and serial noise the same way the driver does
+        let Ok(frame) = serde_json::from_str::<SessionFrame>(line.trim()) else {
+            continue;
+        };
+
+        if frame.ir.len() >= 2 {
+            frames.push(RecordedFrame::from_session(&frame, |id| led_index.get(&id).copied()));
+        }
+    }
+
+    Ok(())
+}
+
+fn run() -> Result<(), String> {
+    let args = parse_args()?;
+
+    let nominal = calibration::load_constellation(&args.constellation)?;
+    let led_index: HashMap<u32, usize> = nominal.iter().enumerate().map(|(i, (id, _))| (*id, i)).collect();
+
+    let mut frames = Vec::new();
+    for session in &args.sessions {
+        load_session(session, &led_index, &mut frames)?;
+    }
+    println!("Loaded {} frames with 2+ blobs from {} session(s)", frames.len(), args.sessions.len());
+
+    let start = Instant::now();
+    let options = SolverOptions { threads: args.threads, max_rms: args.max_rms, ..SolverOptions::default() };
+
+    let mut current = match &args.initial {
+        Some(path) => {
+            // Same mounting, but the IMU has probably rebooted since: find this session's heading
+            let mut initial = Calibration::load(path)?;
+            let (heading, score) = correspondence::estimate_heading(
+                &initial.camera, &initial.camera_mounting, &initial.imu_to_constellation,
+                &initial.led_positions(&nominal), &frames, None, args.threads,
+            ).ok_or("No frames to estimate the IMU heading from")?;
+            println!("IMU heading relative to {}: {:.1}° (mean error {:.1}px)",
+                     path.display(), heading.to_degrees(), score);
+            initial.camera_mounting = initial.camera_rotation(heading);
+            initial
+        }
+        None => {
+            // Nothing is known about the mounting yet, so search every camera rotation
+            let mut seed = Calibration::default();
+            let (rotation, score) = correspondence::seed_camera_rotation(
+                &seed.camera, &seed.imu_to_constellation, &seed.led_positions(&nominal), &frames, args.threads,
+            ).ok_or("No frames to estimate the camera rotation from")?;
+            println!("Camera rotation seed: w={:.3} x={:.3} y={:.3} z={:.3} (mean error {:.1}px)",
+                     rotation.w, rotation.x, rotation.y, rotation.z, score);
+            seed.camera_mounting = rotation;
+            seed
+        }
+    };
+
+    let mut solution = None;
+    let mut initial_rms = None;
+    let mut assigned = 0;
+    for (pass, max_rms) in LABEL_MAX_RMS.iter().enumerate() {
+        let labelled = correspondence::label_frames(
+            &current.camera, &current.camera_mounting, &current.imu_to_constellation,
+            &current.led_positions(&nominal), &frames, *max_rms, args.threads,
+        );
+        println!("Pass {}: {} of {} frames assigned", pass + 1, labelled.len(), frames.len());
+
+        let result = bundle_adjust::solve(&nominal, &labelled, &current, &options)?;
+        initial_rms.get_or_insert(result.initial_rms);
+        assigned = labelled.len();
+        current = result.calibration.clone();
+        solution = Some(result);
+    }
+    let solution = solution.unwrap();
+    let elapsed = start.elapsed();
+
+    let c = &solution.calibration;
+    println!("Solved in {:.2}s ({} iterations, {} frames, {} observations, {} outliers): {:?}",
+             elapsed.as_secs_f64(), solution.iterations, solution.frames_used, c.observations,
+             solution.outliers, solution.convergence);
+    println!("RMS reprojection error: {:.3}px -> {:.3}px", initial_rms.unwrap(), c.rms_reprojection_error);
+    println!("Camera: fx={:.1} fy={:.1} cx={:.1} cy={:.1} k1={:.4} k2={:.4}",
+             c.camera.fx, c.camera.fy, c.camera.cx, c.camera.cy, c.camera.k1, c.camera.k2);
+    for led in &c.leds {
+        println!("LED {}: offset=({:+.4}, {:+.4}, {:+.4})m", led.id, led.offset.x, led.offset.y, led.offset.z);
+    }
+
+    let problem = if solution.convergence != Convergence::Converged {
+        Some(format!("did not converge ({:?})", solution.convergence))
+    } else if (assigned as f64) < MIN_ASSIGNED_FRAMES * frames.len() as f64 {
+        Some(format!("only explains {} of {} frames", assigned, frames.len()))
+    } else {
+        None
+    };
+
+    if let Some(problem) = problem {
+        if !args.force {
+            return Err(format!(
+                "Calibration {problem}; not writing {}. Record more varied motion, \
+                 pass a close --initial calibration, or use --force to write it anyway",
+                args.output.display()
+            ));
+        }
+        eprintln!("Calibration {problem}; writing anyway (--force)");
+    }
+
+    c.save(&args.output)?;
+    println!("Wrote {}", args.output.display());
+    Ok(())
+}
+
+fn main() -> ExitCode {
+    match run() {
+        Ok(()) => ExitCode::SUCCESS,
+        Err(e) => {
+            eprintln!("{e}");
+            ExitCode::FAILURE
+        }
+    }
+}
@@ -0,0 +1,74 @@
+// Records a calibration session straight from the headset and tracking serial ports.
+//
+// Each IR packet is written as one JSON line together with the most recent IMU quaternion, in
+// the format the calibrate tool reads. Close SteamVR first so the ports are free, then move the
+// headset slowly through as many orientations as possible in front of the camera.
+
+use std::{path::PathBuf, process::ExitCode, thread, time::{Duration, Instant}};
+
+use vr_driver::VRDevice;
+
+struct Args {
+    headset_port: String,
+    tracking_port: String,
+    seconds: u64,
+    output: PathBuf,
+}
+
+const USAGE: &str = "Usage: record [--headset COM5] [--tracking COM3] [--seconds 60] [--output session.jsonl]";
+
+fn parse_args() -> Result<Args, String> {
+    let mut args = Args {
+        headset_port: "COM5".to_string(),
+        tracking_port: "COM3".to_string(),
+        seconds: 60,
+        output: PathBuf::from("session.jsonl"),
+    };
+
+    let mut iter = std::env::args().skip(1);
+    while let Some(arg) = iter.next() {
+        let mut value = || iter.next().ok_or(format!("Missing value for {arg}"));
+        match arg.as_str() {
+            "--headset" => args.headset_port = value()?,
+            "--tracking" => args.tracking_port = value()?,
+            "--seconds" => {
+                args.seconds = value()?.parse().map_err(|e| format!("Invalid --seconds: {e}"))?
+            }
+            "--output" | "-o" => args.output = PathBuf::from(value()?),
+            _ => return Err(USAGE.to_string()),
+        }
+    }
+
+    Ok(args)
+}
+
+fn run() -> Result<(), String> {
+    let args = parse_args()?;
+
+    let device = VRDevice::open(&args.headset_port, &args.tracking_port)
+        .ok_or("Failed to open the headset or tracking port")?;
+    device.record_session(&args.output)?;
+    println!("Recording to {} for {}s", args.output.display(), args.seconds);
+
+    let start = Instant::now();
+    while start.elapsed() < Duration::from_secs(args.seconds) {
+        thread::sleep(Duration::from_secs(1));
+        if !device.is_connected() {
+            return Err("Serial connection lost".to_string());
+        }
+        println!("{:>3}s: {} frames", start.elapsed().as_secs(), device.recorded_frames());
+    }
+
+    println!("Recorded {} frames", device.recorded_frames());
+    Ok(())
+}
+
+fn main() -> ExitCode {
+    match run() {
+        Ok(()) => ExitCode::SUCCESS,
+        Err(e) => {
+            eprintln!("{e}");
+            ExitCode::FAILURE
+        }
+    }
+}
@@ -0,0 +1,966 @@
+// Sparse Levenberg-Marquardt bundle adjustment for offline calibration.
+//
+// Unknowns are split into a small global block shared by every frame (camera intrinsics,
+// IMU-to-constellation rotation, camera rotation, per-LED offsets) and one 3-vector per frame
+// (headset translation in the camera frame). Frame orientation comes from the recorded IMU
+// quaternion, so each frame only adds a 3x3 block to the normal equations. The frame blocks are
+// eliminated with the Schur complement, leaving a dense system the size of the global block.
+// Linearization, the Schur reduction and cost evaluation are independent per frame and run on
+// all cores.
+
+use std::{ops::Range, thread};
+
+use crate::{
+    Quaternion,
+    calibration::{CALIBRATION_VERSION, Calibration, CameraIntrinsics, LedCalibration},
+    correspondence, math,
+};
+
+// Layout of the global parameter block
+const INTRINSICS: usize = 0;
+const IMU_ROTATION: usize = 6;
+const CAMERA_ROTATION: usize = 9;
+const LED_OFFSETS: usize = 12;
+
+// Parameters touched by a single observation: intrinsics, both rotations, one LED offset
+const LOCAL: usize = 15;
+
+pub struct Observation {
+    // Index into the constellation passed to `solve`
+    pub led: usize,
+    pub u: f64,
+    pub v: f64,
+}
+
+pub struct Frame {
+    pub orientation: Quaternion,
+    pub observations: Vec<Observation>,
+}
+
+pub struct SolverOptions {
+    pub max_iterations: usize,
+    // Reprojection errors above this (pixels) are down-weighted, so mislabelled blobs can't drag the fit
+    pub huber_delta: f64,
+    // Expected accuracy of the hand-measured LED positions (meters). Also fixes the gauge freedom
+    // between the constellation and the frame translations.
+    pub led_offset_sigma: f64,
+    // 0 = one worker per core
+    pub threads: usize,
+    // Largest acceptable RMS reprojection error of the inliers (pixels)
+    pub max_rms: f64,
+    // Largest acceptable share of observations more than 3 * huber_delta off
+    pub max_outlier_fraction: f64,
+}
+
+impl Default for SolverOptions {
+    fn default() -> Self {
+        SolverOptions {
+            max_iterations: 100,
+            huber_delta: 3.0,
+            led_offset_sigma: 0.002,
+            threads: 0,
+            max_rms: 2.0,
+            max_outlier_fraction: 0.1,
+        }
+    }
+}
+
+#[derive(Clone, Copy, PartialEq, Eq, Debug)]
+pub enum Convergence {
+    Converged,
+    // Still improving when max_iterations ran out
+    IterationLimit,
+    // No damping made progress from a point that is not a minimum
+    Stalled,
+    // Converged, but to a fit worse than max_rms / max_outlier_fraction (usually a local minimum)
+    HighResidual,
+}
+
+pub struct Solution {
+    pub calibration: Calibration,
+    pub convergence: Convergence,
+    pub iterations: usize,
+    pub frames_used: usize,
+    pub initial_rms: f64,
+    pub outliers: usize,
+}
+
+#[derive(Clone)]
+struct Params {
+    camera: CameraIntrinsics,
+    imu_to_constellation: Quaternion,
+    camera_rotation: Quaternion,
+    offsets: Vec<[f64; 3]>,
+    translations: Vec<[f64; 3]>,
+}
+
+struct Problem<'a> {
+    nominal: &'a [[f64; 3]],
+    frames: Vec<&'a Frame>,
+    options: &'a SolverOptions,
+    threads: usize,
+    global_len: usize,
+}
+
+struct ObservationJacobian {
+    residual: [f64; 2],
+    global: [[f64; LOCAL]; 2],
+    translation: [[f64; 3]; 2],
+}
+
+// One frame's contribution to the normal equations that involves its translation
+struct FrameSystem {
+    v: [[f64; 3]; 3],
+    w: Vec<[f64; 3]>,
+    b: [f64; 3],
+}
+
+impl Params {
+    fn local_indices(led: usize) -> [usize; LOCAL] {
+        let mut indices = [0; LOCAL];
+        for (i, index) in indices.iter_mut().enumerate().take(LED_OFFSETS) {
+            *index = i;
+        }
+        for k in 0..3 {
+            indices[LED_OFFSETS + k] = LED_OFFSETS + 3 * led + k;
+        }
+        indices
+    }
+
+    fn residual(&self, nominal: &[[f64; 3]], frame: &Frame, observation: &Observation, t: [f64; 3]) -> Option<[f64; 2]> {
+        let led = math::add(nominal[observation.led], self.offsets[observation.led]);
+        let world = frame.orientation.rotate(self.imu_to_constellation.rotate(led));
+        let p = math::add(self.camera_rotation.rotate(world), t);
+        let [u, v] = self.camera.project(p)?;
+        Some([u - observation.u, v - observation.v])
+    }
+
+    fn linearize(&self, nominal: &[[f64; 3]], frame: &Frame, observation: &Observation, t: [f64; 3]) -> Option<ObservationJacobian> {
+        let led = math::add(nominal[observation.led], self.offsets[observation.led]);
+        let imu = self.imu_to_constellation.rotate(led);
+        let world = frame.orientation.rotate(imu);
+        let rotated = self.camera_rotation.rotate(world);
+        let p = math::add(rotated, t);
+
+        if p[2] <= 1e-6 {
+            return None;
+        }
+
+        let c = &self.camera;
+        let xn = p[0] / p[2];
+        let yn = p[1] / p[2];
+        let r2 = xn * xn + yn * yn;
+        let d = 1.0 + c.k1 * r2 + c.k2 * r2 * r2;
+        let dd_dr2 = c.k1 + 2.0 * c.k2 * r2;
+
+        let residual = [
+            c.fx * xn * d + c.cx - observation.u,
+            c.fy * yn * d + c.cy - observation.v,
+        ];
+
+        // d(u, v) / d(xn, yn)
+        let a = [
+            [c.fx * (d + 2.0 * xn * xn * dd_dr2), c.fx * 2.0 * xn * yn * dd_dr2],
+            [c.fy * 2.0 * xn * yn * dd_dr2, c.fy * (d + 2.0 * yn * yn * dd_dr2)],
+        ];
+
+        // d(u, v) / d(camera-frame point)
+        let inv_z = 1.0 / p[2];
+        let mut jp = [[0.0; 3]; 2];
+        for r in 0..2 {
+            jp[r][0] = a[r][0] * inv_z;
+            jp[r][1] = a[r][1] * inv_z;
+            jp[r][2] = -(a[r][0] * xn + a[r][1] * yn) * inv_z;
+        }
+        let chain = |dp: [f64; 3]| [
+            jp[0][0] * dp[0] + jp[0][1] * dp[1] + jp[0][2] * dp[2],
+            jp[1][0] * dp[0] + jp[1][1] * dp[1] + jp[1][2] * dp[2],
+        ];
+
+        let mut global = [[0.0; LOCAL]; 2];
+        let intrinsics = [
+            [xn * d, 0.0, 1.0, 0.0, c.fx * xn * r2, c.fx * xn * r2 * r2],
+            [0.0, yn * d, 0.0, 1.0, c.fy * yn * r2, c.fy * yn * r2 * r2],
+        ];
+        for r in 0..2 {
+            global[r][INTRINSICS..INTRINSICS + 6].copy_from_slice(&intrinsics[r]);
+        }
+
+        let mut translation = [[0.0; 3]; 2];
+        for k in 0..3 {
+            let mut axis = [0.0; 3];
+            axis[k] = 1.0;
+
+            // Rotations are perturbed on the left: R <- exp(delta) * R
+            let imu_rotation = chain(self.camera_rotation.rotate(frame.orientation.rotate(math::cross(axis, imu))));
+            let camera_rotation = chain(math::cross(axis, rotated));
+            let offset = chain(self.camera_rotation.rotate(frame.orientation.rotate(self.imu_to_constellation.rotate(axis))));
+
+            for r in 0..2 {
+                global[r][IMU_ROTATION + k] = imu_rotation[r];
+                global[r][CAMERA_ROTATION + k] = camera_rotation[r];
+                global[r][LED_OFFSETS + k] = offset[r];
+                translation[r][k] = jp[r][k];
+            }
+        }
+
+        Some(ObservationJacobian { residual, global, translation })
+    }
+
+    fn apply(&self, delta_global: &[f64], delta_translations: &[[f64; 3]]) -> Params {
+        let mut camera = self.camera;
+        camera.fx += delta_global[INTRINSICS];
+        camera.fy += delta_global[INTRINSICS + 1];
+        camera.cx += delta_global[INTRINSICS + 2];
+        camera.cy += delta_global[INTRINSICS + 3];
+        camera.k1 += delta_global[INTRINSICS + 4];
+        camera.k2 += delta_global[INTRINSICS + 5];
+
+        let rotation = |start: usize| {
+            Quaternion::from_rotation_vector([delta_global[start], delta_global[start + 1], delta_global[start + 2]])
+        };
+
+        Params {
+            camera,
+            imu_to_constellation: rotation(IMU_ROTATION).mul(&self.imu_to_constellation).normalized(),
+            camera_rotation: rotation(CAMERA_ROTATION).mul(&self.camera_rotation).normalized(),
+            offsets: self.offsets.iter().enumerate()
+                .map(|(i, o)| math::add(*o, [delta_global[LED_OFFSETS + 3 * i], delta_global[LED_OFFSETS + 3 * i + 1], delta_global[LED_OFFSETS + 3 * i + 2]]))
+                .collect(),
+            translations: self.translations.iter().zip(delta_translations)
+                .map(|(t, dt)| math::add(*t, *dt))
+                .collect(),
+        }
+    }
+}
+
+// Huber loss on the reprojection error norm: returns (cost, IRLS weight)
+fn huber(squared_error: f64, delta: f64) -> (f64, f64) {
+    if squared_error <= delta * delta {
+        (squared_error, 1.0)
+    } else {
+        let error = squared_error.sqrt();
+        (2.0 * delta * error - delta * delta, delta / error)
+    }
+}
+
+fn damp(m: &[[f64; 3]; 3], lambda: f64) -> [[f64; 3]; 3] {
+    let mut out = *m;
+    for i in 0..3 {
+        out[i][i] *= 1.0 + lambda;
+    }
+    out
+}
+
+// 0 = one worker per core
+pub(crate) fn worker_count(threads: usize) -> usize {
+    if threads > 0 {
+        threads
+    } else {
+        thread::available_parallelism().map(|n| n.get()).unwrap_or(1)
+    }
+}
+
+// Split 0..count into one contiguous range per worker and run `work` on each
+pub(crate) fn for_each_chunk<R: Send>(count: usize, threads: usize, work: impl Fn(Range<usize>) -> R + Sync) -> Vec<R> {
+    let chunk = count.div_ceil(threads).max(1);
+    let work = &work;
+
+    thread::scope(|s| {
+        let handles: Vec<_> = (0..count).step_by(chunk)
+            .map(|start| s.spawn(move || work(start..(start + chunk).min(count))))
+            .collect();
+        handles.into_iter().map(|h| h.join().unwrap()).collect()
+    })
+}
+
+impl Problem<'_> {
+    fn for_each_chunk<R: Send>(&self, work: impl Fn(Range<usize>) -> R + Sync) -> Vec<R> {
+        for_each_chunk(self.frames.len(), self.threads, work)
+    }
+
+    fn prior_cost(&self, params: &Params) -> f64 {
+        let inv_var = 1.0 / (self.options.led_offset_sigma * self.options.led_offset_sigma);
+        params.offsets.iter().map(|o| (o[0] * o[0] + o[1] * o[1] + o[2] * o[2]) * inv_var).sum()
+    }
+
+    // Robust cost, or None if a step pushed an LED behind the camera
+    fn cost(&self, params: &Params) -> Option<f64> {
+        let partial = self.for_each_chunk(|range| {
+            let mut cost = 0.0;
+            for f in range {
+                let frame = self.frames[f];
+                for observation in &frame.observations {
+                    let [ru, rv] = params.residual(self.nominal, frame, observation, params.translations[f])?;
+                    cost += huber(ru * ru + rv * rv, self.options.huber_delta).0;
+                }
+            }
+            Some(cost)
+        });
+
+        let mut total = self.prior_cost(params);
+        for cost in partial {
+            total += cost?;
+        }
+        Some(total)
+    }
+
+    // RMS reprojection error (pixels) of the inliers, and the number of outliers
+    fn rms_reprojection_error(&self, params: &Params) -> (f64, usize) {
+        let outlier_threshold = 3.0 * self.options.huber_delta;
+        let partial = self.for_each_chunk(|range| {
+            let (mut sum, mut count, mut outliers) = (0.0, 0usize, 0usize);
+            for f in range {
+                let frame = self.frames[f];
+                for observation in &frame.observations {
+                    match params.residual(self.nominal, frame, observation, params.translations[f]) {
+                        Some([ru, rv]) if ru * ru + rv * rv <= outlier_threshold * outlier_threshold => {
+                            sum += ru * ru + rv * rv;
+                            count += 1;
+                        }
+                        _ => outliers += 1,
+                    }
+                }
+            }
+            (sum, count, outliers)
+        });
+
+        let (sum, count, outliers) = partial.into_iter()
+            .fold((0.0, 0, 0), |acc, p| (acc.0 + p.0, acc.1 + p.1, acc.2 + p.2));
+        (if count > 0 { (sum / count as f64).sqrt() } else { 0.0 }, outliers)
+    }
+
+    // Build the normal equations J^T W J * delta = -J^T W r: the dense global block (row-major) and
+    // gradient, plus the per-frame blocks
+    fn linearize(&self, params: &Params) -> (Vec<f64>, Vec<f64>, Vec<FrameSystem>) {
+        let g = self.global_len;
+
+        let partial = self.for_each_chunk(|range| {
+            let mut u = vec![0.0; g * g];
+            let mut b = vec![0.0; g];
+            let mut systems = Vec::with_capacity(range.len());
+
+            for f in range {
+                let frame = self.frames[f];
+                let mut system = FrameSystem { v: [[0.0; 3]; 3], w: vec![[0.0; 3]; g], b: [0.0; 3] };
+
+                for observation in &frame.observations {
+                    let Some(jac) = params.linearize(self.nominal, frame, observation, params.translations[f]) else {
+                        continue;
+                    };
+                    let [ru, rv] = jac.residual;
+                    let weight = huber(ru * ru + rv * rv, self.options.huber_delta).1;
+                    let indices = Params::local_indices(observation.led);
+
+                    for r in 0..2 {
+                        let jg = &jac.global[r];
+                        let jt = &jac.translation[r];
+                        let wr = weight * jac.residual[r];
+
+                        for (a, &ia) in indices.iter().enumerate() {
+                            let wja = weight * jg[a];
+                            for (bi, &ib) in indices.iter().enumerate() {
+                                u[ia * g + ib] += wja * jg[bi];
+                            }
+                            for k in 0..3 {
+                                system.w[ia][k] += wja * jt[k];
+                            }
+                            b[ia] -= jg[a] * wr;
+                        }
+                        for i in 0..3 {
+                            for k in 0..3 {
+                                system.v[i][k] += weight * jt[i] * jt[k];
+                            }
+                            system.b[i] -= jt[i] * wr;
+                        }
+                    }
+                }
+
+                systems.push(system);
+            }
+
+            (u, b, systems)
+        });
+
+        let mut u = vec![0.0; g * g];
+        let mut b = vec![0.0; g];
+        let mut systems = Vec::with_capacity(self.frames.len());
+        for (pu, pb, ps) in partial {
+            u.iter_mut().zip(pu).for_each(|(x, y)| *x += y);
+            b.iter_mut().zip(pb).for_each(|(x, y)| *x += y);
+            systems.extend(ps);
+        }
+
+        let inv_var = 1.0 / (self.options.led_offset_sigma * self.options.led_offset_sigma);
+        for (i, offset) in params.offsets.iter().enumerate() {
+            for k in 0..3 {
+                let index = LED_OFFSETS + 3 * i + k;
+                u[index * g + index] += inv_var;
+                b[index] -= offset[k] * inv_var;
+            }
+        }
+
+        (u, b, systems)
+    }
+
+    // Solve the damped system by eliminating the frame translations (Schur complement)
+    fn solve_step(&self, u: &[f64], b: &[f64], systems: &[FrameSystem], lambda: f64) -> Option<(Vec<f64>, Vec<[f64; 3]>)> {
+        let g = self.global_len;
+
+        let partial = self.for_each_chunk(|range| {
+            let mut s = vec![0.0; g * g];
+            let mut rhs = vec![0.0; g];
+
+            for system in &systems[range] {
+                let v_inv = math::invert_3x3(&damp(&system.v, lambda))?;
+
+                // y = W * V^-1, only rows touched by this frame are non-zero
+                for i in 0..g {
+                    let wi = system.w[i];
+                    if wi == [0.0; 3] {
+                        continue;
+                    }
+                    let yi = [
+                        wi[0] * v_inv[0][0] + wi[1] * v_inv[1][0] + wi[2] * v_inv[2][0],
+                        wi[0] * v_inv[0][1] + wi[1] * v_inv[1][1] + wi[2] * v_inv[2][1],
+                        wi[0] * v_inv[0][2] + wi[1] * v_inv[1][2] + wi[2] * v_inv[2][2],
+                    ];
+                    for j in 0..g {
+                        let wj = system.w[j];
+                        s[i * g + j] += yi[0] * wj[0] + yi[1] * wj[1] + yi[2] * wj[2];
+                    }
+                    rhs[i] += yi[0] * system.b[0] + yi[1] * system.b[1] + yi[2] * system.b[2];
+                }
+            }
+
+            Some((s, rhs))
+        });
+
+        let mut s: Vec<f64> = u.to_vec();
+        for i in 0..g {
+            s[i * g + i] *= 1.0 + lambda;
+        }
+        let mut rhs = b.to_vec();
+        for part in partial {
+            let (ps, prhs) = part?;
+            s.iter_mut().zip(ps).for_each(|(x, y)| *x -= y);
+            rhs.iter_mut().zip(prhs).for_each(|(x, y)| *x -= y);
+        }
+
+        let delta_global = math::cholesky_solve(&mut s, &rhs)?;
+
+        // Back-substitute: delta_t = V^-1 * (b_t - W^T * delta_global)
+        let delta_translations = systems.iter().map(|system| {
+            let v_inv = math::invert_3x3(&damp(&system.v, lambda))?;
+            let mut r = system.b;
+            for (i, wi) in system.w.iter().enumerate() {
+                for k in 0..3 {
+                    r[k] -= wi[k] * delta_global[i];
+                }
+            }
+            Some([
+                v_inv[0][0] * r[0] + v_inv[0][1] * r[1] + v_inv[0][2] * r[2],
+                v_inv[1][0] * r[0] + v_inv[1][1] * r[1] + v_inv[1][2] * r[2],
+                v_inv[2][0] * r[0] + v_inv[2][1] * r[1] + v_inv[2][2] * r[2],
+            ])
+        }).collect::<Option<Vec<_>>>()?;
+
+        Some((delta_global, delta_translations))
+    }
+
+    // Largest cosine between the weighted residual and any parameter's Jacobian column (MINPACK's
+    // gtol test). It ignores damping and parameter units, and is ~0 only at a stationary point.
+    fn gradient_cosine(&self, u: &[f64], b: &[f64], systems: &[FrameSystem], cost: f64) -> f64 {
+        if cost <= f64::MIN_POSITIVE {
+            return 0.0;
+        }
+
+        let g = self.global_len;
+        let global = (0..g).map(|i| (b[i], u[i * g + i]));
+        let frames = systems.iter().flat_map(|s| (0..3).map(move |k| (s.b[k], s.v[k][k])));
+
+        global.chain(frames)
+            .filter(|&(_, diagonal)| diagonal > 0.0)
+            .map(|(gradient, diagonal)| gradient.abs() / (diagonal * cost).sqrt())
+            .fold(0.0, f64::max)
+    }
+}
+
+const GRADIENT_TOLERANCE: f64 = 1e-6;
+const RELATIVE_DECREASE_TOLERANCE: f64 = 1e-6;
+const MAX_LAMBDA: f64 = 1e12;
+
+struct Minimum<P> {
+    params: P,
+    convergence: Convergence,
+    iterations: usize,
+}
+
+// Levenberg-Marquardt driver, kept apart from the problem so its stopping rules can be tested on
+// their own. `linearize` returns the normal equations at a point along with their gradient
+// cosine, and `step` solves them with the given damping.
+fn levenberg_marquardt<P, L>(
+    mut params: P,
+    mut cost: f64,
+    max_iterations: usize,
+    cost_of: impl Fn(&P) -> Option<f64>,
+    linearize: impl Fn(&P, f64) -> (L, f64),
+    step: impl Fn(&P, &L, f64) -> Option<P>,
+) -> Minimum<P> {
+    let mut lambda = 1e-4;
+    let mut iterations = 0;
+    let mut convergence = Convergence::IterationLimit;
+
+    'outer: while iterations < max_iterations {
+        iterations += 1;
+        let (system, gradient_cosine) = linearize(&params, cost);
+        if gradient_cosine <= GRADIENT_TOLERANCE {
+            convergence = Convergence::Converged;
+            break;
+        }
+
+        loop {
+            if lambda >= MAX_LAMBDA {
+                convergence = Convergence::Stalled;
+                break 'outer;
+            }
+
+            let Some(candidate) = step(&params, &system, lambda) else {
+                lambda *= 10.0;
+                continue;
+            };
+
+            match cost_of(&candidate) {
+                Some(new_cost) if new_cost < cost => {
+                    let relative_decrease = (cost - new_cost) / cost.max(1e-300);
+                    // Heavily damped steps are short however far the minimum is, so only a small
+                    // decrease from a nearly Gauss-Newton step counts as convergence
+                    let undamped = lambda <= 1.0;
+                    params = candidate;
+                    cost = new_cost;
+                    lambda = (lambda * 0.1).max(1e-12);
+                    if undamped && relative_decrease < RELATIVE_DECREASE_TOLERANCE {
+                        convergence = Convergence::Converged;
+                        break 'outer;
+                    }
+                    break;
+                }
+                _ => lambda *= 10.0,
+            }
+        }
+    }
+
+    Minimum { params, convergence, iterations }
+}
+
+// Least-squares headset translation for one frame with the rotations held fixed
+fn initial_translation(params: &Params, nominal: &[[f64; 3]], frame: &Frame) -> [f64; 3] {
+    let camera = &params.camera;
+    let rotation = params.camera_rotation.mul(&frame.orientation).mul(&params.imu_to_constellation);
+
+    let rays: Vec<[f64; 2]> = frame.observations.iter()
+        .map(|o| {
+            let (x, y) = camera.undistort_pixel(o.u, o.v);
+            [(x - camera.cx) / camera.fx, (y - camera.cy) / camera.fy]
+        })
+        .collect();
+    let rotated: Vec<[f64; 3]> = frame.observations.iter()
+        .map(|o| rotation.rotate(math::add(nominal[o.led], params.offsets[o.led])))
+        .collect();
+
+    correspondence::fit_translation(&rays, &rotated).unwrap_or([0.0, 0.0, 1.0])
+}
+
+// Jointly refine camera intrinsics, LED offsets and the IMU/camera rotations.
+// `nominal` holds the hand-measured LED positions as (id, position); observations index into it.
+// `initial` supplies the starting intrinsics, rotations and any LED offsets from a previous run;
+// its camera mounting must already match the heading the IMU had while these frames were recorded.
+// The result's mounting is relative to that same heading.
+pub fn solve(
+    nominal: &[(u32, [f64; 3])],
+    frames: &[Frame],
+    initial: &Calibration,
+    options: &SolverOptions,
+) -> Result<Solution, String> {
+    let positions: Vec<[f64; 3]> = nominal.iter().map(|(_, p)| *p).collect();
+
+    // A frame needs at least two blobs to constrain its own translation
+    let frames: Vec<&Frame> = frames.iter()
+        .filter(|f| f.observations.len() >= 2 && f.observations.iter().all(|o| o.led < positions.len()))
+        .collect();
+    if frames.is_empty() {
+        return Err("No frames with at least two labelled blobs".to_string());
+    }
+
+    let threads = worker_count(options.threads);
+
+    let problem = Problem {
+        nominal: &positions,
+        frames,
+        options,
+        threads,
+        global_len: LED_OFFSETS + 3 * positions.len(),
+    };
+
+    let mut params = Params {
+        camera: initial.camera,
+        imu_to_constellation: initial.imu_to_constellation.normalized(),
+        camera_rotation: initial.camera_mounting.normalized(),
+        offsets: nominal.iter()
+            .map(|(id, _)| initial.leds.iter().find(|led| led.id == *id).map_or([0.0; 3], |led| led.offset.into()))
+            .collect(),
+        translations: Vec::new(),
+    };
+    params.translations = problem.frames.iter()
+        .map(|frame| initial_translation(&params, &positions, frame))
+        .collect();
+
+    let (initial_rms, _) = problem.rms_reprojection_error(&params);
+    let cost = problem.cost(&params)
+        .ok_or("Initial guess places LEDs behind the camera; check the camera mounting")?;
+
+    let Minimum { params, mut convergence, iterations } = levenberg_marquardt(
+        params,
+        cost,
+        options.max_iterations,
+        |params| problem.cost(params),
+        |params, cost| {
+            let (u, b, systems) = problem.linearize(params);
+            let gradient_cosine = problem.gradient_cosine(&u, &b, &systems, cost);
+            ((u, b, systems), gradient_cosine)
+        },
+        |params, (u, b, systems), lambda| {
+            let (delta_global, delta_translations) = problem.solve_step(u, b, systems, lambda)?;
+            Some(params.apply(&delta_global, &delta_translations))
+        },
+    );
+
+    let (rms, outliers) = problem.rms_reprojection_error(&params);
+    let observations: usize = problem.frames.iter().map(|f| f.observations.len()).sum();
+
+    if convergence == Convergence::Converged
+        && (rms > options.max_rms || outliers as f64 > options.max_outlier_fraction * observations as f64)
+    {
+        convergence = Convergence::HighResidual;
+    }
+
+    let leds = nominal.iter().zip(&params.offsets)
+        .map(|((id, position), offset)| LedCalibration {
+            id: *id,
+            position: math::add(*position, *offset).into(),
+            offset: (*offset).into(),
+        })
+        .collect();
+
+    Ok(Solution {
+        calibration: Calibration {
+            version: CALIBRATION_VERSION,
+            camera: params.camera,
+            imu_to_constellation: params.imu_to_constellation,
+            camera_mounting: params.camera_rotation,
+            leds,
+            rms_reprojection_error: rms,
+            observations,
+        },
+        convergence,
+        iterations,
+        frames_used: problem.frames.len(),
+        initial_rms,
+        outliers,
+    })
+}
+
+#[cfg(test)]
+pub(crate) mod tests {
+    use super::*;
+    use crate::calibration::{heading_rotation, load_constellation};
+    use std::{f64::consts::FRAC_PI_2, path::Path};
+
+    // xorshift64*, so the synthetic sessions are reproducible without a rand dependency
+    pub(crate) struct Rng(u64);
+
+    impl Rng {
+        pub(crate) fn new(seed: u64) -> Self {
+            Rng(seed.wrapping_mul(0x9E37_79B9_7F4A_7C15) | 1)
+        }
+
+        pub(crate) fn uniform(&mut self, low: f64, high: f64) -> f64 {
+            self.0 ^= self.0 >> 12;
+            self.0 ^= self.0 << 25;
+            self.0 ^= self.0 >> 27;
+            let bits = self.0.wrapping_mul(0x2545_F491_4F6C_DD1D) >> 11;
+            low + (high - low) * (bits as f64 / (1u64 << 53) as f64)
+        }
+
+        pub(crate) fn gaussian(&mut self, sigma: f64) -> f64 {
+            let u1 = self.uniform(1e-12, 1.0);
+            let u2 = self.uniform(0.0, 1.0);
+            sigma * (-2.0 * u1.ln()).sqrt() * (2.0 * std::f64::consts::PI * u2).cos()
+        }
+    }
+
+    pub(crate) fn nominal() -> Vec<(u32, [f64; 3])> {
+        load_constellation(&Path::new(env!("CARGO_MANIFEST_DIR")).join("../led_constellation.json")).unwrap()
+    }
+
+    // Test rig: the camera stands level, its optical axis horizontal in the IMU's world frame
+    pub(crate) fn level_mounting() -> Quaternion {
+        Calibration::default().camera_mounting.mul(&Quaternion::from_rotation_vector([FRAC_PI_2, 0.0, 0.0]))
+    }
+
+    // Starting point for solves on the test rig
+    pub(crate) fn rig() -> Calibration {
+        Calibration { camera_mounting: level_mounting(), ..Calibration::default() }
+    }
+
+    // A unit whose camera, LEDs and mounting all differ from the rig's. `heading` is the IMU's
+    // heading during the recording, relative to the one `rig()` assumes.
+    pub(crate) fn truth(nominal: &[(u32, [f64; 3])], heading: f64, rng: &mut Rng) -> Calibration {
+        Calibration {
+            camera: CameraIntrinsics { fx: 1690.0, fy: 1705.0, cx: 520.0, cy: 378.0, k1: -0.08, k2: 0.01 },
+            imu_to_constellation: Quaternion::from_rotation_vector([0.02, 0.06, 0.02]),
+            camera_mounting: Quaternion::from_rotation_vector([0.01, 0.05, -0.03])
+                .mul(&level_mounting())
+                .mul(&heading_rotation(heading)),
+            leds: nominal.iter().map(|(id, p)| {
+                let offset = [rng.gaussian(0.002), rng.gaussian(0.002), rng.gaussian(0.002)];
+                LedCalibration { id: *id, position: math::add(*p, offset).into(), offset: offset.into() }
+            }).collect(),
+            ..Calibration::default()
+        }
+    }
+
+    // Labelled frames of the headset moving in front of the camera, as seen through `truth`
+    pub(crate) fn synthetic_frames(truth: &Calibration, count: usize, noise: f64, rng: &mut Rng) -> Vec<Frame> {
+        let leds: Vec<[f64; 3]> = truth.leds.iter().map(|led| led.position.into()).collect();
+        let facing = Calibration::default().camera_mounting;
+        let mut frames = Vec::new();
+
+        while frames.len() < count {
+            // Headset-to-camera rotation near face-on, then back out the IMU reading that gives it
+            let wobble = Quaternion::from_rotation_vector([
+                rng.uniform(-0.35, 0.35),
+                rng.uniform(-0.7, 0.7),
+                rng.uniform(-0.35, 0.35),
+            ]);
+            let headset_to_camera = facing.mul(&wobble);
+            let orientation = truth.camera_mounting.conjugate()
+                .mul(&headset_to_camera)
+                .mul(&truth.imu_to_constellation.conjugate());
+            let t = [rng.uniform(-0.2, 0.2), rng.uniform(-0.15, 0.15), rng.uniform(0.8, 1.8)];
+
+            let mut observations: Vec<Observation> = leds.iter().enumerate()
+                .filter_map(|(led, p)| {
+                    let [u, v] = truth.camera.project(math::add(headset_to_camera.rotate(*p), t))?;
+                    let (u, v) = (u + rng.gaussian(noise), v + rng.gaussian(noise));
+                    ((0.0..1024.0).contains(&u) && (0.0..768.0).contains(&v)).then_some(Observation { led, u, v })
+                })
+                .collect();
+
+            // The camera tracks at most 4 blobs; drop a random one so every LED gets seen
+            if observations.len() > 4 {
+                let drop = (rng.uniform(0.0, observations.len() as f64) as usize).min(observations.len() - 1);
+                observations.remove(drop);
+            }
+
+            if observations.len() >= 2 {
+                frames.push(Frame { orientation, observations });
+            }
+        }
+
+        frames
+    }
+
+    pub(crate) fn rotation_error(a: &Quaternion, b: &Quaternion) -> f64 {
+        let d = a.conjugate().mul(b);
+        2.0 * d.w.abs().min(1.0).acos()
+    }
+
+    #[test]
+    fn jacobian_matches_finite_differences() {
+        let mut rng = Rng::new(7);
+        let nominal = nominal();
+        let truth = truth(&nominal, 0.3, &mut rng);
+        let positions: Vec<[f64; 3]> = nominal.iter().map(|(_, p)| *p).collect();
+        let frames = synthetic_frames(&truth, 1, 0.0, &mut rng);
+        let frame = &frames[0];
+
+        let params = Params {
+            camera: truth.camera,
+            imu_to_constellation: truth.imu_to_constellation,
+            camera_rotation: truth.camera_mounting,
+            offsets: truth.leds.iter().map(|led| led.offset.into()).collect(),
+            translations: vec![[0.05, -0.03, 1.2]],
+        };
+        let t = params.translations[0];
+        let global_len = LED_OFFSETS + 3 * positions.len();
+
+        for observation in &frame.observations {
+            let jac = params.linearize(&positions, frame, observation, t).unwrap();
+            let indices = Params::local_indices(observation.led);
+
+            for (local, &index) in indices.iter().enumerate() {
+                let h = if index < INTRINSICS + 4 { 1e-3 } else { 1e-6 };
+                let mut delta = vec![0.0; global_len];
+                delta[index] = h;
+                let plus = params.apply(&delta, &[[0.0; 3]]).residual(&positions, frame, observation, t).unwrap();
+                delta[index] = -h;
+                let minus = params.apply(&delta, &[[0.0; 3]]).residual(&positions, frame, observation, t).unwrap();
+
+                for r in 0..2 {
+                    let numeric = (plus[r] - minus[r]) / (2.0 * h);
+                    let analytic = jac.global[r][local];
+                    assert!((numeric - analytic).abs() <= 1e-4 * (1.0 + analytic.abs()),
+                            "global {index} row {r}: analytic {analytic}, numeric {numeric}");
+                }
+            }
+
+            for k in 0..3 {
+                let h = 1e-6;
+                let mut tp = t;
+                tp[k] += h;
+                let mut tm = t;
+                tm[k] -= h;
+                let plus = params.residual(&positions, frame, observation, tp).unwrap();
+                let minus = params.residual(&positions, frame, observation, tm).unwrap();
+
+                for r in 0..2 {
+                    let numeric = (plus[r] - minus[r]) / (2.0 * h);
+                    let analytic = jac.translation[r][k];
+                    assert!((numeric - analytic).abs() <= 1e-4 * (1.0 + analytic.abs()),
+                            "translation {k} row {r}: analytic {analytic}, numeric {numeric}");
+                }
+            }
+        }
+    }
+
+    #[test]
+    fn solve_recovers_synthetic_calibration() {
+        let mut rng = Rng::new(1);
+        let nominal = nominal();
+        let truth = truth(&nominal, 0.0, &mut rng);
+        let frames = synthetic_frames(&truth, 600, 0.3, &mut rng);
+
+        let solution = solve(&nominal, &frames, &rig(), &SolverOptions::default()).unwrap();
+        let c = &solution.calibration;
+
+        assert_eq!(solution.convergence, Convergence::Converged);
+        assert!(c.rms_reprojection_error < 0.5, "rms {}", c.rms_reprojection_error);
+        assert!((c.camera.fx - truth.camera.fx).abs() < 0.005 * truth.camera.fx, "fx {}", c.camera.fx);
+        assert!((c.camera.fy - truth.camera.fy).abs() < 0.005 * truth.camera.fy, "fy {}", c.camera.fy);
+        // The principal point trades off against a small camera rotation (10px is about 0.3 degrees)
+        assert!((c.camera.cx - truth.camera.cx).abs() < 15.0, "cx {}", c.camera.cx);
+        assert!((c.camera.cy - truth.camera.cy).abs() < 15.0, "cy {}", c.camera.cy);
+        assert!((c.camera.k1 - truth.camera.k1).abs() < 0.02, "k1 {}", c.camera.k1);
+        assert!(rotation_error(&c.camera_mounting, &truth.camera_mounting) < 1.0_f64.to_radians());
+
+        // A rotation of the whole constellation trades off exactly against imu_to_constellation, a shift
+        // against the frame translations and a scale against their depth, so compare the LEDs as the
+        // IMU sees them, centred and scaled onto the truth
+        let imu_frame = |calibration: &Calibration| {
+            let points: Vec<[f64; 3]> = calibration.leds.iter()
+                .map(|led| calibration.imu_to_constellation.rotate(led.position.into()))
+                .collect();
+            let centroid = math::scale(points.iter().fold([0.0; 3], |acc, p| math::add(acc, *p)), 1.0 / points.len() as f64);
+            points.into_iter().map(|p| math::sub(p, centroid)).collect::<Vec<_>>()
+        };
+        let (estimated, actual) = (imu_frame(c), imu_frame(&truth));
+        let dot = |a: &[f64; 3], b: &[f64; 3]| a[0] * b[0] + a[1] * b[1] + a[2] * b[2];
+        let scale = estimated.iter().zip(&actual).map(|(e, a)| dot(e, a)).sum::<f64>()
+            / estimated.iter().map(|e| dot(e, e)).sum::<f64>();
+        assert!((scale - 1.0).abs() < 0.02, "scale {scale}");
+        for (i, (estimated, actual)) in estimated.iter().zip(actual).enumerate() {
+            let error = math::norm(math::sub(math::scale(*estimated, scale), actual));
+            assert!(error < 0.002, "LED {i} off by {:.2}mm", error * 1000.0);
+        }
+    }
+
+    // Cost x^2 + 1 with exact Gauss-Newton steps, scaled down by the damping
+    fn quadratic_step(x: &f64, _: &(), lambda: f64) -> Option<f64> {
+        Some(x - x / (1.0 + lambda))
+    }
+
+    #[test]
+    fn levenberg_marquardt_converges_on_quadratic() {
+        let minimum = levenberg_marquardt(
+            3.0, 10.0, 100,
+            |x| Some(x * x + 1.0),
+            |x, cost| ((), x.abs() / cost.sqrt()),
+            quadratic_step,
+        );
+        assert_eq!(minimum.convergence, Convergence::Converged);
+        assert!(minimum.params.abs() < 1e-3);
+    }
+
+    #[test]
+    fn levenberg_marquardt_reports_stall_when_no_step_helps() {
+        // The model promises a decrease that the cost never delivers, at any damping: the shrinking
+        // steps must end as Stalled, not be mistaken for convergence
+        let minimum = levenberg_marquardt(
+            3.0, 10.0, 100,
+            |x| Some(if *x == 3.0 { 10.0 } else { 11.0 }),
+            |_, _| ((), 1.0),
+            quadratic_step,
+        );
+        assert_eq!(minimum.convergence, Convergence::Stalled);
+        assert_eq!(minimum.params, 3.0);
+        assert_eq!(minimum.iterations, 1);
+    }
+
+    #[test]
+    fn levenberg_marquardt_does_not_converge_on_damped_steps() {
+        // Every step only pays off once heavily damped, and then by very little: that is a poor
+        // model, not a minimum
+        let minimum = levenberg_marquardt(
+            3.0, 10.0, 20,
+            |x| Some(if (x - 3.0).abs() < 1e-6 { 10.0 - (3.0 - x) } else { 11.0 }),
+            |_, _| ((), 1.0),
+            quadratic_step,
+        );
+        assert_ne!(minimum.convergence, Convergence::Converged);
+    }
+
+    #[test]
+    fn solve_flags_iteration_limit() {
+        let mut rng = Rng::new(3);
+        let nominal = nominal();
+        let truth = truth(&nominal, 0.6, &mut rng);
+        let frames = synthetic_frames(&truth, 300, 0.3, &mut rng);
+
+        let options = SolverOptions { max_iterations: 3, ..SolverOptions::default() };
+        let solution = solve(&nominal, &frames, &rig(), &options).unwrap();
+        assert_eq!(solution.convergence, Convergence::IterationLimit);
+    }
+
+    #[test]
+    fn solve_rejects_mounting_facing_away() {
+        // A heading half a turn off puts every LED behind the camera; the tool must estimate it first
+        let mut rng = Rng::new(3);
+        let nominal = nominal();
+        let truth = truth(&nominal, std::f64::consts::PI, &mut rng);
+        let frames = synthetic_frames(&truth, 50, 0.3, &mut rng);
+
+        assert!(solve(&nominal, &frames, &rig(), &SolverOptions::default()).is_err());
+    }
+
+    #[test]
+    fn solve_flags_high_residual() {
+        let mut rng = Rng::new(4);
+        let nominal = nominal();
+        let truth = truth(&nominal, 0.0, &mut rng);
+        let frames = synthetic_frames(&truth, 300, 4.0, &mut rng);
+
+        let solution = solve(&nominal, &frames, &truth, &SolverOptions::default()).unwrap();
+        assert_eq!(solution.convergence, Convergence::HighResidual);
+    }
+
+    #[test]
+    fn solve_rejects_sessions_without_usable_frames() {
+        let frames = vec![Frame {
+            orientation: Quaternion::IDENTITY,
+            observations: vec![Observation { led: 0, u: 512.0, v: 384.0 }],
+        }];
+        assert!(solve(&nominal(), &frames, &Calibration::default(), &SolverOptions::default()).is_err());
+    }
+
+}
@@ -0,0 +1,374 @@
+use std::{fs, path::Path};
+
+use serde::{Deserialize, Serialize};
+
+use crate::{Quaternion, Vec3, math};
+
+// Bump whenever the layout of the calibration file changes
+pub const CALIBRATION_VERSION: u32 = 2;
+
+// Vertical axis of the IMU's world frame. The BNO055 fusion output has its world Z along gravity,
+// and the firmware's axis remap (x = -y, y = -x, z = -z) keeps it on Z.
+pub const VERTICAL_AXIS: [f64; 3] = [0.0, 0.0, 1.0];
+
+// Hand-tuned LED spacing the driver has always used for depth. It is not the mean pairwise
+// distance of led_constellation.json (about 72mm), so a calibration only rescales it by how much
+// the constellation changed; a calibration that leaves the LEDs alone keeps the same depth scale.
+pub const DEFAULT_LED_SPACING: f64 = 0.085;
+
+#[derive(Clone, Copy, Serialize, Deserialize)]
+pub struct CameraIntrinsics {
+    pub fx: f64,
+    pub fy: f64,
+    pub cx: f64,
+    pub cy: f64,
+    // Radial distortion: r_distorted = r * (1 + k1 * r^2 + k2 * r^4) in normalized coordinates
+    pub k1: f64,
+    pub k2: f64,
+}
+
+impl Default for CameraIntrinsics {
+    fn default() -> Self {
+        // Wiimote IR camera specs (33° horizontal FOV, 1024×768 output)
+        // f = (1024/2) / tan(33°/2) ≈ 1728
+        CameraIntrinsics {
+            fx: 1728.0,
+            fy: 1728.0,
+            cx: 512.0,
+            cy: 384.0,
+            k1: 0.0,
+            k2: 0.0,
+        }
+    }
+}
+
+impl CameraIntrinsics {
+    pub fn project(&self, p: [f64; 3]) -> Option<[f64; 2]> {
+        if p[2] <= 1e-6 {
+            return None;
+        }
+        let xn = p[0] / p[2];
+        let yn = p[1] / p[2];
+        let r2 = xn * xn + yn * yn;
+        let d = 1.0 + self.k1 * r2 + self.k2 * r2 * r2;
+        Some([self.fx * xn * d + self.cx, self.fy * yn * d + self.cy])
+    }
+
+    // Remove lens distortion from a pixel, returning the pixel an ideal pinhole camera would see
+    pub fn undistort_pixel(&self, u: f64, v: f64) -> (f64, f64) {
+        let xd = (u - self.cx) / self.fx;
+        let yd = (v - self.cy) / self.fy;
+
+        // Fixed-point inversion, converges in a handful of steps for the small k of this lens
+        let (mut xn, mut yn) = (xd, yd);
+        for _ in 0..8 {
+            let r2 = xn * xn + yn * yn;
+            let d = 1.0 + self.k1 * r2 + self.k2 * r2 * r2;
+            xn = xd / d;
+            yn = yd / d;
+        }
+
+        (xn * self.fx + self.cx, yn * self.fy + self.cy)
+    }
+}
+
+#[derive(Clone, Serialize, Deserialize)]
+pub struct LedCalibration {
+    pub id: u32,
+    // Refined position in the constellation frame (nominal position + offset)
+    pub position: Vec3,
+    // Correction applied to the hand-measured position from led_constellation.json
+    pub offset: Vec3,
+}
+
+#[derive(Clone, Serialize, Deserialize)]
+pub struct Calibration {
+    pub version: u32,
+    pub camera: CameraIntrinsics,
+    // Constellation (headset) orientation relative to the IMU: q_headset = q_imu * imu_to_constellation
+    pub imu_to_constellation: Quaternion,
+    // Rotation from the IMU world frame into the camera frame, for the IMU heading of the session
+    // this was solved from. The IMU's heading can differ on every boot and only rotates its world
+    // frame about VERTICAL_AXIS, so users of this apply their own heading via `camera_rotation`.
+    pub camera_mounting: Quaternion,
+    pub leds: Vec<LedCalibration>,
+    #[serde(default)]
+    pub rms_reprojection_error: f64,
+    #[serde(default)]
+    pub observations: usize,
+}
+
+impl Default for Calibration {
+    fn default() -> Self {
+        Calibration {
+            version: CALIBRATION_VERSION,
+            camera: CameraIntrinsics::default(),
+            imu_to_constellation: Quaternion::IDENTITY,
+            // Camera faces the headset: X unchanged, Y inverted (image rows grow downward), Z = depth
+            camera_mounting: Quaternion { w: 0.0, x: 1.0, y: 0.0, z: 0.0 },
+            leds: Vec::new(),
+            rms_reprojection_error: 0.0,
+            observations: 0,
+        }
+    }
+}
+
+impl Calibration {
+    pub fn load(path: &Path) -> Result<Self, String> {
+        let text = fs::read_to_string(path)
+            .map_err(|e| format!("Failed to read {}: {}", path.display(), e))?;
+        let calibration: Calibration = serde_json::from_str(&text)
+            .map_err(|e| format!("Failed to parse {}: {}", path.display(), e))?;
+
+        if calibration.version != CALIBRATION_VERSION {
+            return Err(format!(
+                "Unsupported calibration version {} in {} (expected {})",
+                calibration.version,
+                path.display(),
+                CALIBRATION_VERSION
+            ));
+        }
+
+        calibration.validated().map_err(|e| format!("Invalid calibration {}: {}", path.display(), e))
+    }
+
+    // Reject values that would turn every position into NaN or inf (forced or hand-edited files),
+    // and normalize the rotations
+    fn validated(mut self) -> Result<Self, String> {
+        let c = &self.camera;
+        if ![c.fx, c.fy, c.cx, c.cy, c.k1, c.k2].iter().all(|v| v.is_finite()) {
+            return Err("camera intrinsics must be finite".to_string());
+        }
+        if c.fx <= 0.0 || c.fy <= 0.0 {
+            return Err(format!("focal lengths must be positive (fx={}, fy={})", c.fx, c.fy));
+        }
+
+        for (name, q) in [
+            ("imu_to_constellation", &mut self.imu_to_constellation),
+            ("camera_mounting", &mut self.camera_mounting),
+        ] {
+            let norm = (q.w * q.w + q.x * q.x + q.y * q.y + q.z * q.z).sqrt();
+            if !norm.is_finite() || norm < 1e-6 {
+                return Err(format!("{name} is not a valid rotation"));
+            }
+            *q = q.normalized();
+        }
+
+        for (i, led) in self.leds.iter().enumerate() {
+            let position: [f64; 3] = led.position.into();
+            let offset: [f64; 3] = led.offset.into();
+            if !position.iter().chain(&offset).all(|v| v.is_finite()) {
+                return Err(format!("LED {} position must be finite", led.id));
+            }
+            if self.leds[..i].iter().any(|other| other.id == led.id) {
+                return Err(format!("LED {} appears more than once", led.id));
+            }
+        }
+
+        let spacing = self.average_led_spacing();
+        if !spacing.is_finite() || spacing <= 0.0 {
+            return Err("LED positions must not coincide".to_string());
+        }
+
+        Ok(self)
+    }
+
+    pub fn save(&self, path: &Path) -> Result<(), String> {
+        let text = serde_json::to_string_pretty(self)
+            .map_err(|e| format!("Failed to serialize calibration: {}", e))?;
+        fs::write(path, text).map_err(|e| format!("Failed to write {}: {}", path.display(), e))
+    }
+
+    // Rotation from the IMU world frame into the camera frame when the IMU's heading differs from
+    // the calibration session's by `heading` radians
+    pub fn camera_rotation(&self, heading: f64) -> Quaternion {
+        self.camera_mounting.mul(&heading_rotation(heading))
+    }
+
+    // Nominal positions with this calibration's offsets applied (matched by LED id)
+    pub fn led_positions(&self, nominal: &[(u32, [f64; 3])]) -> Vec<[f64; 3]> {
+        nominal.iter()
+            .map(|(id, position)| match self.leds.iter().find(|led| led.id == *id) {
+                Some(led) => math::add(*position, led.offset.into()),
+                None => *position,
+            })
+            .collect()
+    }
+
+    // LED spacing for depth estimation: the default, scaled by how much the calibrated constellation
+    // grew or shrank relative to the hand-measured one
+    pub fn average_led_spacing(&self) -> f64 {
+        let calibrated = mean_pairwise_distance(self.leds.iter().map(|led| led.position.into()));
+        let nominal = mean_pairwise_distance(
+            self.leds.iter().map(|led| math::sub(led.position.into(), led.offset.into())),
+        );
+
+        match (calibrated, nominal) {
+            (Some(calibrated), Some(nominal)) if nominal > 0.0 => DEFAULT_LED_SPACING * calibrated / nominal,
+            _ => DEFAULT_LED_SPACING,
+        }
+    }
+}
+
+// Change of the IMU world frame when its heading moves by `heading` radians
+pub fn heading_rotation(heading: f64) -> Quaternion {
+    Quaternion::from_rotation_vector(math::scale(VERTICAL_AXIS, heading))
+}
+
+fn mean_pairwise_distance(points: impl Iterator<Item = [f64; 3]>) -> Option<f64> {
+    let points: Vec<[f64; 3]> = points.collect();
+    let mut sum = 0.0;
+    let mut count = 0;
+
+    for (i, a) in points.iter().enumerate() {
+        for b in &points[i + 1..] {
+            sum += math::norm(math::sub(*a, *b));
+            count += 1;
+        }
+    }
+
+    if count > 0 { Some(sum / count as f64) } else { None }
+}
+
+// One line of a recorded calibration session: an IR packet paired with the latest IMU sample
+#[derive(Serialize, Deserialize)]
+pub struct SessionFrame {
+    // Seconds since recording started
+    #[serde(default)]
+    pub t: f64,
+    pub w: f64,
+    pub x: f64,
+    pub y: f64,
+    pub z: f64,
+    #[serde(default)]
+    pub ir: Vec<SessionBlob>,
+}
+
+#[derive(Serialize, Deserialize)]
+pub struct SessionBlob {
+    pub x: f64,
+    pub y: f64,
+    #[serde(default)]
+    pub s: u8,
+    // LED id from led_constellation.json, only present in hand-labelled sessions
+    #[serde(default, skip_serializing_if = "Option::is_none")]
+    pub id: Option<u32>,
+}
+
+#[derive(Deserialize)]
+struct ConstellationJson {
+    leds: Vec<ConstellationLedJson>,
+}
+
+#[derive(Deserialize)]
+struct ConstellationLedJson {
+    id: u32,
+    position: Vec3,
+}
+
+// Hand-measured LED positions from led_constellation.json, as (id, position) pairs
+pub fn load_constellation(path: &Path) -> Result<Vec<(u32, [f64; 3])>, String> {
+    let text = fs::read_to_string(path)
+        .map_err(|e| format!("Failed to read {}: {}", path.display(), e))?;
+    let constellation: ConstellationJson = serde_json::from_str(&text)
+        .map_err(|e| format!("Failed to parse {}: {}", path.display(), e))?;
+
+    Ok(constellation.leds.into_iter().map(|led| (led.id, led.position.into())).collect())
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn constellation_path() -> std::path::PathBuf {
+        Path::new(env!("CARGO_MANIFEST_DIR")).join("../led_constellation.json")
+    }
+
+    #[test]
+    fn project_and_undistort_round_trip() {
+        let camera = CameraIntrinsics { fx: 1690.0, fy: 1705.0, cx: 520.0, cy: 378.0, k1: -0.08, k2: 0.02 };
+
+        for p in [[0.0, 0.0, 1.0], [0.1, -0.05, 1.2], [-0.15, 0.1, 0.9], [0.2, 0.15, 1.5]] {
+            let [u, v] = camera.project(p).unwrap();
+            let (x, y) = camera.undistort_pixel(u, v);
+            assert!((x - (camera.fx * p[0] / p[2] + camera.cx)).abs() < 1e-6);
+            assert!((y - (camera.fy * p[1] / p[2] + camera.cy)).abs() < 1e-6);
+        }
+
+        assert!(camera.project([0.0, 0.0, -1.0]).is_none());
+    }
+
+    fn with_offsets(nominal: &[(u32, [f64; 3])], offset: impl Fn([f64; 3]) -> [f64; 3]) -> Calibration {
+        Calibration {
+            leds: nominal.iter().map(|(id, p)| {
+                let offset = offset(*p);
+                LedCalibration { id: *id, position: math::add(*p, offset).into(), offset: offset.into() }
+            }).collect(),
+            ..Calibration::default()
+        }
+    }
+
+    #[test]
+    fn led_spacing_scales_the_default() {
+        let nominal = load_constellation(&constellation_path()).unwrap();
+        assert_eq!(Calibration::default().average_led_spacing(), DEFAULT_LED_SPACING);
+
+        // A calibration that leaves the LEDs alone must not change the depth scale
+        let unchanged = with_offsets(&nominal, |_| [0.0; 3]);
+        assert!((unchanged.average_led_spacing() - DEFAULT_LED_SPACING).abs() < 1e-12);
+
+        // One that finds the constellation 2% larger scales depth by the same ratio
+        let larger = with_offsets(&nominal, |p| math::scale(p, 0.02));
+        assert!((larger.average_led_spacing() - 1.02 * DEFAULT_LED_SPACING).abs() < 1e-12);
+    }
+
+    #[test]
+    fn save_load_round_trip_and_version_check() {
+        let path = std::env::temp_dir().join(format!("vr_driver_calibration_{}.json", std::process::id()));
+
+        let mut calibration = Calibration::default();
+        calibration.camera.fx = 1700.5;
+        calibration.save(&path).unwrap();
+        assert_eq!(Calibration::load(&path).unwrap().camera.fx, 1700.5);
+
+        calibration.version = CALIBRATION_VERSION + 1;
+        calibration.save(&path).unwrap();
+        assert!(Calibration::load(&path).is_err());
+
+        let _ = fs::remove_file(&path);
+    }
+
+    #[test]
+    fn load_rejects_unusable_values() {
+        let path = std::env::temp_dir().join(format!("vr_driver_invalid_{}.json", std::process::id()));
+        let nominal = load_constellation(&constellation_path()).unwrap();
+        let valid = with_offsets(&nominal, |_| [0.001, 0.0, -0.001]);
+
+        let mut scaled = valid.clone();
+        scaled.camera_mounting = Quaternion { w: 0.0, x: 2.0, y: 0.0, z: 0.0 };
+        scaled.save(&path).unwrap();
+        assert!((Calibration::load(&path).unwrap().camera_mounting.x - 1.0).abs() < 1e-12);
+
+        let mut zero_focal = valid.clone();
+        zero_focal.camera.fx = 0.0;
+        zero_focal.save(&path).unwrap();
+        assert!(Calibration::load(&path).is_err());
+
+        // JSON has no inf or NaN, but a file can still overflow or be built in code
+        let broken: [fn(&mut Calibration); 6] = [
+            |c| c.camera.fy = -1728.0,
+            |c| c.camera.k1 = f64::INFINITY,
+            |c| c.imu_to_constellation = Quaternion { w: 0.0, x: 0.0, y: 0.0, z: 0.0 },
+            |c| c.camera_mounting.w = f64::NAN,
+            |c| c.leds[1].id = c.leds[0].id,
+            |c| c.leds[2].position.x = f64::NAN,
+        ];
+        for (i, breakage) in broken.iter().enumerate() {
+            let mut calibration = valid.clone();
+            breakage(&mut calibration);
+            assert!(calibration.validated().is_err(), "case {i} was accepted");
+        }
+
+        let _ = fs::remove_file(&path);
+    }
+}
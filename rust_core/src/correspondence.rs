@@ -0,0 +1,476 @@
+// Blob-to-LED correspondence for calibration sessions.
+//
+// The IR camera reports anonymous blobs. With the frame's IMU orientation and a rough
+// calibration, the only unknown left per frame is the headset translation, which is linear in
+// the blob rays. Every assignment of blobs to LEDs (at most 5P4 = 120) is tried, each gets a
+// least-squares translation, and the one that reprojects best wins.
+
+use crate::{
+    Quaternion,
+    bundle_adjust::{self, Frame, Observation},
+    calibration::{CameraIntrinsics, SessionFrame, heading_rotation},
+    math,
+};
+
+// A blob from a recorded session: pixel position, and the LED index if the recording was labelled
+pub struct RecordedBlob {
+    pub u: f64,
+    pub v: f64,
+    pub led: Option<usize>,
+}
+
+pub struct RecordedFrame {
+    pub orientation: Quaternion,
+    pub blobs: Vec<RecordedBlob>,
+}
+
+impl RecordedFrame {
+    // `led_index` maps constellation ids to indices; unknown ids are treated as unlabelled
+    pub fn from_session(frame: &SessionFrame, led_index: impl Fn(u32) -> Option<usize>) -> Self {
+        RecordedFrame {
+            orientation: Quaternion { w: frame.w, x: frame.x, y: frame.y, z: frame.z }.normalized(),
+            blobs: frame.ir.iter()
+                .map(|blob| RecordedBlob { u: blob.x, v: blob.y, led: blob.id.and_then(&led_index) })
+                .collect(),
+        }
+    }
+
+    fn is_labelled(&self) -> bool {
+        self.blobs.iter().all(|b| b.led.is_some())
+    }
+}
+
+// Best assignment for one frame
+pub struct FrameFit {
+    pub leds: Vec<usize>,
+    pub translation: [f64; 3],
+    // RMS reprojection error of the best assignment, and of the runner-up (pixels)
+    pub rms: f64,
+    pub runner_up_rms: f64,
+}
+
+// Headset translation that best puts the rotated LEDs on the rays through their blobs.
+// `rays` are undistorted normalized image coordinates (x/z, y/z).
+pub fn fit_translation(rays: &[[f64; 2]], rotated: &[[f64; 3]]) -> Option<[f64; 3]> {
+    // Each blob gives (r + t)_x - a (r + t)_z = 0 and (r + t)_y - b (r + t)_z = 0
+    let mut ata = [[0.0; 3]; 3];
+    let mut atb = [0.0; 3];
+    for (ray, r) in rays.iter().zip(rotated) {
+        let rows = [
+            ([1.0, 0.0, -ray[0]], ray[0] * r[2] - r[0]),
+            ([0.0, 1.0, -ray[1]], ray[1] * r[2] - r[1]),
+        ];
+        for (a, b) in rows {
+            for i in 0..3 {
+                for j in 0..3 {
+                    ata[i][j] += a[i] * a[j];
+                }
+                atb[i] += a[i] * b;
+            }
+        }
+    }
+
+    let inv = math::invert_3x3(&ata)?;
+    Some([
+        inv[0][0] * atb[0] + inv[0][1] * atb[1] + inv[0][2] * atb[2],
+        inv[1][0] * atb[0] + inv[1][1] * atb[1] + inv[1][2] * atb[2],
+        inv[2][0] * atb[0] + inv[2][1] * atb[1] + inv[2][2] * atb[2],
+    ])
+}
+
+// RMS reprojection error of one assignment, or None if an LED ends up behind the camera
+fn assignment_rms(camera: &CameraIntrinsics, pixels: &[(f64, f64)], rotated: &[[f64; 3]], t: [f64; 3]) -> Option<f64> {
+    let mut sum = 0.0;
+    for (pixel, r) in pixels.iter().zip(rotated) {
+        let [u, v] = camera.project(math::add(*r, t))?;
+        sum += (u - pixel.0).powi(2) + (v - pixel.1).powi(2);
+    }
+    Some((sum / pixels.len() as f64).sqrt())
+}
+
+// Try every injective blob -> LED assignment (or just the recorded one, if labelled).
+// `rotation` takes constellation coordinates into the camera frame for this frame.
+pub fn fit_frame(
+    camera: &CameraIntrinsics,
+    rotation: &Quaternion,
+    leds: &[[f64; 3]],
+    frame: &RecordedFrame,
+) -> Option<FrameFit> {
+    let n = frame.blobs.len();
+    if n < 2 || n > leds.len() {
+        return None;
+    }
+
+    let pixels: Vec<(f64, f64)> = frame.blobs.iter().map(|b| (b.u, b.v)).collect();
+    let rays: Vec<[f64; 2]> = pixels.iter()
+        .map(|&(u, v)| {
+            let (x, y) = camera.undistort_pixel(u, v);
+            [(x - camera.cx) / camera.fx, (y - camera.cy) / camera.fy]
+        })
+        .collect();
+    let rotated_leds: Vec<[f64; 3]> = leds.iter().map(|p| rotation.rotate(*p)).collect();
+
+    let mut best: Option<FrameFit> = None;
+    let mut runner_up_rms = f64::INFINITY;
+    let mut assignment = Vec::with_capacity(n);
+    let mut rotated = Vec::with_capacity(n);
+
+    let mut consider = |assignment: &[usize], rotated: &[[f64; 3]]| {
+        let Some(t) = fit_translation(&rays, rotated) else { return };
+        let Some(rms) = assignment_rms(camera, &pixels, rotated, t) else { return };
+
+        let best_rms = best.as_ref().map_or(f64::INFINITY, |b| b.rms);
+        if rms < best_rms {
+            runner_up_rms = best_rms;
+            best = Some(FrameFit { leds: assignment.to_vec(), translation: t, rms, runner_up_rms: f64::INFINITY });
+        } else {
+            runner_up_rms = runner_up_rms.min(rms);
+        }
+    };
+
+    if frame.is_labelled() {
+        assignment.extend(frame.blobs.iter().map(|b| b.led.unwrap()));
+        rotated.extend(assignment.iter().map(|&led| rotated_leds[led]));
+        consider(&assignment, &rotated);
+    } else {
+        // Depth-first over assignments; `used` is a bitmask of LEDs already taken
+        fn search(
+            blob: usize,
+            used: u32,
+            rotated_leds: &[[f64; 3]],
+            assignment: &mut Vec<usize>,
+            rotated: &mut Vec<[f64; 3]>,
+            n: usize,
+            consider: &mut dyn FnMut(&[usize], &[[f64; 3]]),
+        ) {
+            if blob == n {
+                consider(assignment, rotated);
+                return;
+            }
+            for (led, r) in rotated_leds.iter().enumerate() {
+                if used & (1 << led) != 0 {
+                    continue;
+                }
+                assignment.push(led);
+                rotated.push(*r);
+                search(blob + 1, used | (1 << led), rotated_leds, assignment, rotated, n, consider);
+                assignment.pop();
+                rotated.pop();
+            }
+        }
+        search(0, 0, &rotated_leds, &mut assignment, &mut rotated, n, &mut consider);
+    }
+
+    best.map(|b| FrameFit { runner_up_rms, ..b })
+}
+
+fn frame_rotation(camera_rotation: &Quaternion, imu_to_constellation: &Quaternion, frame: &RecordedFrame) -> Quaternion {
+    camera_rotation.mul(&frame.orientation).mul(imu_to_constellation)
+}
+
+// Assign blobs to LEDs for every frame under the given calibration. Frames whose best assignment
+// is worse than `max_rms` pixels, or not clearly better than the runner-up, are dropped.
+pub fn label_frames(
+    camera: &CameraIntrinsics,
+    camera_rotation: &Quaternion,
+    imu_to_constellation: &Quaternion,
+    leds: &[[f64; 3]],
+    frames: &[RecordedFrame],
+    max_rms: f64,
+    threads: usize,
+) -> Vec<Frame> {
+    let threads = bundle_adjust::worker_count(threads);
+
+    bundle_adjust::for_each_chunk(frames.len(), threads, |range| {
+        frames[range].iter().filter_map(|frame| {
+            let rotation = frame_rotation(camera_rotation, imu_to_constellation, frame);
+            let fit = fit_frame(camera, &rotation, leds, frame)?;
+
+            // Mirror-image LED pairs can fit almost equally well; keep only unambiguous frames
+            if fit.rms > max_rms || (!frame.is_labelled() && fit.runner_up_rms < 2.0 * fit.rms.max(0.5)) {
+                return None;
+            }
+
+            Some(Frame {
+                orientation: frame.orientation,
+                observations: frame.blobs.iter().zip(&fit.leds)
+                    .map(|(blob, &led)| Observation { led, u: blob.u, v: blob.v })
+                    .collect(),
+            })
+        }).collect::<Vec<_>>()
+    }).into_iter().flatten().collect()
+}
+
+// Frames scored per candidate rotation when searching for the camera rotation or IMU heading
+const SAMPLE_FRAMES: usize = 32;
+
+// Per-frame error cap, so a few unexplainable frames don't dominate a search score
+const MAX_FRAME_RMS: f64 = 30.0;
+
+// Up to SAMPLE_FRAMES frames spread over the session. Frames with three or more blobs constrain a
+// rotation far better than pairs, so those are used when there are enough of them.
+fn sample_frames<'a>(frames: &'a [RecordedFrame], leds: usize) -> Vec<&'a RecordedFrame> {
+    let mut candidates: Vec<&RecordedFrame> = frames.iter().filter(|f| f.blobs.len() >= 3 && f.blobs.len() <= leds).collect();
+    if candidates.len() < SAMPLE_FRAMES {
+        candidates = frames.iter().filter(|f| f.blobs.len() >= 2 && f.blobs.len() <= leds).collect();
+    }
+    let step = (candidates.len() / SAMPLE_FRAMES).max(1);
+    candidates.into_iter().step_by(step).take(SAMPLE_FRAMES).collect()
+}
+
+// Mean best-assignment error (pixels) of the sample under a camera rotation
+fn rotation_score(
+    camera: &CameraIntrinsics,
+    camera_rotation: &Quaternion,
+    imu_to_constellation: &Quaternion,
+    leds: &[[f64; 3]],
+    sample: &[&RecordedFrame],
+) -> f64 {
+    sample.iter().map(|frame| {
+        let rotation = frame_rotation(camera_rotation, imu_to_constellation, frame);
+        fit_frame(camera, &rotation, leds, frame).map_or(MAX_FRAME_RMS, |fit| fit.rms.min(MAX_FRAME_RMS))
+    }).sum::<f64>() / sample.len() as f64
+}
+
+// Lowest-scoring candidate, scored on all workers
+fn best_of<T: Copy + Send + Sync>(candidates: &[T], threads: usize, score: impl Fn(&T) -> f64 + Sync) -> (T, f64) {
+    let pick = |best: (T, f64), c: (T, f64)| if c.1 < best.1 { c } else { best };
+    let threads = bundle_adjust::worker_count(threads);
+
+    bundle_adjust::for_each_chunk(candidates.len(), threads, |range| {
+        candidates[range].iter().map(|c| (*c, score(c))).reduce(pick)
+    }).into_iter().flatten().reduce(pick).unwrap()
+}
+
+// Estimate the camera rotation by scoring a grid over all orientations on a sample of frames,
+// then refining around the best cell. Nothing is known about the mounting before the first
+// calibration, so no single default is close enough for Levenberg-Marquardt. The result is
+// relative to the IMU heading during this session.
+pub fn seed_camera_rotation(
+    camera: &CameraIntrinsics,
+    imu_to_constellation: &Quaternion,
+    leds: &[[f64; 3]],
+    frames: &[RecordedFrame],
+    threads: usize,
+) -> Option<(Quaternion, f64)> {
+    let sample = sample_frames(frames, leds.len());
+    if sample.is_empty() {
+        return None;
+    }
+    let score = |rotation: &Quaternion| rotation_score(camera, rotation, imu_to_constellation, leds, &sample);
+
+    let axis_rotation = |axis: usize, degrees: f64| {
+        let mut v = [0.0; 3];
+        v[axis] = degrees.to_radians();
+        Quaternion::from_rotation_vector(v)
+    };
+
+    // Coarse: Euler angles (Z * X * Y) on a 30° grid, covering every orientation
+    let mut coarse = Vec::new();
+    for yaw in (0..12).map(|i| i as f64 * 30.0) {
+        for pitch in (-3..=3).map(|i| i as f64 * 30.0) {
+            for roll in (0..12).map(|i| i as f64 * 30.0) {
+                coarse.push(axis_rotation(2, roll).mul(&axis_rotation(0, pitch)).mul(&axis_rotation(1, yaw)));
+            }
+        }
+    }
+    let (mut best, mut best_score) = best_of(&coarse, threads, score);
+
+    // Fine: perturbations around the best cell, shrinking the step each round
+    for step in [10.0, 4.0] {
+        let mut fine = Vec::new();
+        for x in -2..=2 {
+            for y in -2..=2 {
+                for z in -2..=2 {
+                    let delta = [x as f64 * step, y as f64 * step, z as f64 * step].map(|d: f64| d.to_radians());
+                    fine.push(Quaternion::from_rotation_vector(delta).mul(&best));
+                }
+            }
+        }
+        (best, best_score) = best_of(&fine, threads, score);
+    }
+
+    Some((best, best_score))
+}
+
+// Estimate how far the IMU's heading has turned since `camera_mounting` was solved, in radians,
+// along with the mean error (pixels) it leaves. The IMU's world frame may come up with a different
+// heading after every boot, while the mounting itself stays put. `around` limits the search to
+// +-15° of a previous estimate, for following drift; otherwise every heading is tried.
+pub fn estimate_heading(
+    camera: &CameraIntrinsics,
+    camera_mounting: &Quaternion,
+    imu_to_constellation: &Quaternion,
+    leds: &[[f64; 3]],
+    frames: &[RecordedFrame],
+    around: Option<f64>,
+    threads: usize,
+) -> Option<(f64, f64)> {
+    let sample = sample_frames(frames, leds.len());
+    if sample.is_empty() {
+        return None;
+    }
+    let score = |heading: &f64| {
+        let rotation = camera_mounting.mul(&heading_rotation(*heading));
+        rotation_score(camera, &rotation, imu_to_constellation, leds, &sample)
+    };
+
+    let coarse: Vec<f64> = match around {
+        Some(heading) => (-3..=3).map(|i| heading + (i as f64 * 5.0).to_radians()).collect(),
+        None => (0..72).map(|i| (i as f64 * 5.0).to_radians()).collect(),
+    };
+    let (mut best, mut best_score) = best_of(&coarse, threads, score);
+
+    for step in [1.0_f64, 0.25] {
+        let fine: Vec<f64> = (-4..=4).map(|i| best + (i as f64 * step).to_radians()).collect();
+        (best, best_score) = best_of(&fine, threads, score);
+    }
+
+    // Wrap into (-pi, pi]
+    let heading = best - std::f64::consts::TAU * ((best + std::f64::consts::PI) / std::f64::consts::TAU).floor();
+    Some((heading, best_score))
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::{
+        bundle_adjust::tests::{Rng, nominal, rotation_error, synthetic_frames, truth},
+        calibration::Calibration,
+    };
+
+    // Strip the labels and shuffle the blobs, as the IR camera would report them
+    fn unlabel(frames: &[Frame], rng: &mut Rng) -> Vec<RecordedFrame> {
+        frames.iter().map(|frame| {
+            let mut blobs: Vec<RecordedBlob> = frame.observations.iter()
+                .map(|o| RecordedBlob { u: o.u, v: o.v, led: None })
+                .collect();
+            for i in (1..blobs.len()).rev() {
+                let j = rng.uniform(0.0, (i + 1) as f64) as usize;
+                blobs.swap(i, j.min(i));
+            }
+            RecordedFrame { orientation: frame.orientation, blobs }
+        }).collect()
+    }
+
+    #[test]
+    fn fit_translation_recovers_exact_translation() {
+        let rotation = Quaternion::from_rotation_vector([0.1, -0.2, 0.05]);
+        let t = [0.08, -0.04, 1.3];
+        let points = [[0.03, 0.02, 0.01], [-0.04, 0.03, -0.02], [0.0, -0.05, 0.03]];
+
+        let rotated: Vec<[f64; 3]> = points.iter().map(|p| rotation.rotate(*p)).collect();
+        let rays: Vec<[f64; 2]> = rotated.iter()
+            .map(|r| {
+                let p = math::add(*r, t);
+                [p[0] / p[2], p[1] / p[2]]
+            })
+            .collect();
+
+        let fitted = fit_translation(&rays, &rotated).unwrap();
+        for k in 0..3 {
+            assert!((fitted[k] - t[k]).abs() < 1e-9);
+        }
+    }
+
+    #[test]
+    fn label_frames_recovers_assignment() {
+        let mut rng = Rng::new(11);
+        let nominal = nominal();
+        let truth = truth(&nominal, 0.0, &mut rng);
+        let frames = synthetic_frames(&truth, 200, 0.3, &mut rng);
+        let recorded = unlabel(&frames, &mut rng);
+        let positions: Vec<[f64; 3]> = truth.leds.iter().map(|led| led.position.into()).collect();
+
+        let labelled = label_frames(
+            &truth.camera, &truth.camera_mounting, &truth.imu_to_constellation,
+            &positions, &recorded, 5.0, 0,
+        );
+        assert!(labelled.len() > 180, "only {} of 200 frames assigned", labelled.len());
+
+        // Every kept assignment must match the LED that produced the blob
+        for frame in &labelled {
+            let source = frames.iter()
+                .find(|f| f.orientation.w == frame.orientation.w && f.orientation.x == frame.orientation.x)
+                .unwrap();
+            for o in &frame.observations {
+                let expected = source.observations.iter().find(|s| s.u == o.u && s.v == o.v).unwrap();
+                assert_eq!(o.led, expected.led);
+            }
+        }
+    }
+
+    #[test]
+    fn seed_finds_camera_rotation_for_any_heading() {
+        for heading in [0.6, std::f64::consts::FRAC_PI_2, 3.0] {
+            let mut rng = Rng::new(5);
+            let nominal = nominal();
+            let truth = truth(&nominal, heading, &mut rng);
+            let frames = synthetic_frames(&truth, 100, 0.3, &mut rng);
+            let recorded = unlabel(&frames, &mut rng);
+            let defaults = Calibration::default();
+
+            let (rotation, _) = seed_camera_rotation(
+                &defaults.camera, &defaults.imu_to_constellation,
+                &defaults.led_positions(&nominal), &recorded, 0,
+            ).unwrap();
+
+            let error = rotation_error(&rotation, &truth.camera_mounting);
+            assert!(error < 10.0_f64.to_radians(), "heading {heading}: seed off by {:.1}°", error.to_degrees());
+        }
+    }
+
+    #[test]
+    fn estimate_heading_recovers_turn_since_calibration() {
+        let mut rng = Rng::new(8);
+        let nominal = nominal();
+        let calibrated = truth(&nominal, 0.0, &mut rng);
+        let leds: Vec<[f64; 3]> = calibrated.leds.iter().map(|led| led.position.into()).collect();
+
+        for heading in [0.0, 0.4, -2.0, 3.1] {
+            // A later boot: same unit and mounting, IMU world frame turned by `heading`
+            let boot = Calibration { camera_mounting: calibrated.camera_rotation(heading), ..calibrated.clone() };
+            let recorded = unlabel(&synthetic_frames(&boot, 20, 0.3, &mut rng), &mut rng);
+
+            let (estimate, error) = estimate_heading(
+                &calibrated.camera, &calibrated.camera_mounting, &calibrated.imu_to_constellation,
+                &leds, &recorded, None, 1,
+            ).unwrap();
+            let off = (estimate - heading + std::f64::consts::PI).rem_euclid(std::f64::consts::TAU) - std::f64::consts::PI;
+            assert!(off.abs() < 0.5_f64.to_radians(), "heading {heading}: estimated {estimate}");
+            assert!(error < 1.0, "heading {heading}: mean error {error}px");
+
+            // Following drift from the previous estimate
+            let (tracked, _) = estimate_heading(
+                &calibrated.camera, &calibrated.camera_mounting, &calibrated.imu_to_constellation,
+                &leds, &recorded, Some(heading + 0.15), 1,
+            ).unwrap();
+            let off = (tracked - heading + std::f64::consts::PI).rem_euclid(std::f64::consts::TAU) - std::f64::consts::PI;
+            assert!(off.abs() < 0.5_f64.to_radians(), "heading {heading}: tracked {tracked}");
+        }
+    }
+
+    #[test]
+    fn recalibration_from_previous_file_needs_heading() {
+        // The documented --initial path: a previous calibration, a session recorded after a reboot
+        let mut rng = Rng::new(9);
+        let nominal = nominal();
+        let previous = truth(&nominal, 0.0, &mut rng);
+        let heading = 2.5;
+        let session = Calibration { camera_mounting: previous.camera_rotation(heading), ..previous.clone() };
+        let recorded = unlabel(&synthetic_frames(&session, 300, 0.3, &mut rng), &mut rng);
+        let leds = previous.led_positions(&nominal);
+
+        let (estimate, _) = estimate_heading(
+            &previous.camera, &previous.camera_mounting, &previous.imu_to_constellation, &leds, &recorded, None, 0,
+        ).unwrap();
+        let start = Calibration { camera_mounting: previous.camera_rotation(estimate), ..previous.clone() };
+
+        let labelled = label_frames(
+            &start.camera, &start.camera_mounting, &start.imu_to_constellation, &leds, &recorded, 5.0, 0,
+        );
+        let solution = bundle_adjust::solve(&nominal, &labelled, &start, &bundle_adjust::SolverOptions::default()).unwrap();
+        assert_eq!(solution.convergence, bundle_adjust::Convergence::Converged);
+        assert!(rotation_error(&solution.calibration.camera_mounting, &session.camera_mounting) < 1.0_f64.to_radians());
+    }
+}
@@ -1,6 +1,14 @@
-use std::{ffi::{CStr, c_char}, fs::OpenOptions, io::{BufRead, BufReader, Write}, sync::{Arc, Mutex}, thread, time::Duration};
+use std::{ffi::{CStr, c_char}, fs::{File, OpenOptions}, io::{BufRead, BufReader, LineWriter, Write}, path::Path, sync::{Arc, Mutex}, thread, time::{Duration, Instant}};
 
-use serde::Deserialize;
+use serde::{Deserialize, Serialize};
+
+use calibration::{Calibration, SessionBlob, SessionFrame};
+use correspondence::{RecordedBlob, RecordedFrame};
+
+pub mod bundle_adjust;
+pub mod calibration;
+pub mod correspondence;
+mod math;
 
 #[repr(C)]
 #[derive(Clone, Copy)]
@@ -28,10 +36,125 @@ struct TrackingData {
     smoothed_position: Vec3,
     button_m: bool,
     connected: bool,
+    session_log: Option<SessionLog>,
+    calibration: Arc<Calibration>,
+    // Only tracked with a loaded calibration; the defaults have no mounting to be relative to
+    heading: Option<HeadingTracker>,
+}
+
+// The camera mounting in a calibration file is relative to the IMU's heading while it was recorded,
+// but the IMU's world frame can come up with a different heading after every boot (and drift).
+// The heading is estimated from live frames against the mounting, and then re-estimated as it goes.
+struct HeadingTracker {
+    // Radians relative to the calibration session, None until the first estimate
+    heading: Option<f64>,
+    frames: Vec<RecordedFrame>,
+}
+
+// Frames (with 3+ blobs) per heading estimate, and the largest mean error accepted (pixels)
+const HEADING_FRAMES: usize = 20;
+const HEADING_MAX_ERROR: f64 = 5.0;
+
+// Frames queued for a heading estimate, with the calibration they are to be matched against
+struct HeadingBatch {
+    calibration: Arc<Calibration>,
+    frames: Vec<RecordedFrame>,
+    previous: Option<f64>,
+}
+
+impl HeadingBatch {
+    fn estimate(&self) -> Option<f64> {
+        let c = &self.calibration;
+        let leds: Vec<[f64; 3]> = c.leds.iter().map(|led| led.position.into()).collect();
+        let search = |around| {
+            correspondence::estimate_heading(&c.camera, &c.camera_mounting, &c.imu_to_constellation, &leds, &self.frames, around, 1)
+                .filter(|(_, error)| *error <= HEADING_MAX_ERROR)
+                .map(|(heading, _)| heading)
+        };
+
+        // Follow drift near the previous estimate, and search everywhere if the heading jumped
+        search(self.previous).or_else(|| self.previous.and_then(|_| search(None)))
+    }
+}
+
+impl TrackingData {
+    // Queue the latest IR packet for the heading estimate, returning a batch once enough are in
+    fn queue_heading_frame(&mut self) -> Option<HeadingBatch> {
+        let tracker = self.heading.as_mut()?;
+        if self.ir_blobs.len() < 3 || self.ir_blobs.len() > self.calibration.leds.len() {
+            return None;
+        }
+
+        tracker.frames.push(RecordedFrame {
+            orientation: self.quaternion.normalized(),
+            blobs: self.ir_blobs.iter()
+                .map(|blob| RecordedBlob { u: blob.x as f64, v: blob.y as f64, led: None })
+                .collect(),
+        });
+        if tracker.frames.len() < HEADING_FRAMES {
+            return None;
+        }
+
+        Some(HeadingBatch {
+            calibration: Arc::clone(&self.calibration),
+            frames: std::mem::take(&mut tracker.frames),
+            previous: tracker.heading,
+        })
+    }
+
+    fn apply_heading(&mut self, batch: &HeadingBatch, heading: Option<f64>) {
+        // Ignore estimates made against a calibration that has been replaced since
+        if !Arc::ptr_eq(&self.calibration, &batch.calibration) {
+            return;
+        }
+        if let (Some(tracker), Some(heading)) = (self.heading.as_mut(), heading) {
+            if tracker.heading.is_none() {
+                println!("IMU heading relative to calibration: {:.1}°", heading.to_degrees());
+            }
+            tracker.heading = Some(heading);
+        }
+    }
+
+    // Heading to apply to the camera mounting, or None while it is still unknown
+    fn current_heading(&self) -> Option<f64> {
+        match &self.heading {
+            Some(tracker) => tracker.heading,
+            None => Some(0.0),
+        }
+    }
+}
+
+// Calibration recording: one line per IR packet, paired with the latest IMU sample
+struct SessionLog {
+    writer: LineWriter<File>,
+    start: Instant,
+    frames: usize,
+}
+
+impl SessionLog {
+    fn write(&mut self, quaternion: &Quaternion, ir_blobs: &[IRBlob]) -> std::io::Result<()> {
+        let frame = SessionFrame {
+            t: self.start.elapsed().as_secs_f64(),
+            w: quaternion.w,
+            x: quaternion.x,
+            y: quaternion.y,
+            z: quaternion.z,
+            ir: ir_blobs.iter().map(|blob| SessionBlob {
+                x: blob.x as f64,
+                y: blob.y as f64,
+                s: blob.size,
+                id: None,
+            }).collect(),
+        };
+
+        writeln!(self.writer, "{}", serde_json::to_string(&frame)?)?;
+        self.frames += 1;
+        Ok(())
+    }
 }
 
 #[repr(C)]
-#[derive(Clone, Copy)]
+#[derive(Clone, Copy, Serialize, Deserialize)]
 pub struct Quaternion {
     pub w: f64,
     pub x: f64,
@@ -40,7 +163,7 @@ pub struct Quaternion {
 }
 
 #[repr(C)]
-#[derive(Clone, Copy)]
+#[derive(Clone, Copy, Serialize, Deserialize)]
 pub struct Vec3 {
     pub x: f64,
     pub y: f64,
@@ -72,12 +195,42 @@ impl VRDevice {
                 smoothed_position: Vec3 { x: 0.0, y: 0.0, z: 0.0 },
                 button_m: false,
                 connected: false,
+                session_log: None,
+                calibration: Arc::new(Calibration::default()),
+                heading: None,
             })),
             headset_thread: None,
             tracking_thread: None,
         }
     }
 
+    // Connect to both serial ports, for tools that use the device without SteamVR
+    pub fn open(headset_port: &str, tracking_port: &str) -> Option<VRDevice> {
+        let mut device = VRDevice::new();
+        if device.connect(headset_port, tracking_port) { Some(device) } else { None }
+    }
+
+    // Start logging every IR packet with the latest IMU sample, for the calibrate tool
+    pub fn record_session(&self, path: &Path) -> Result<(), String> {
+        let file = File::create(path).map_err(|e| format!("Failed to create {}: {}", path.display(), e))?;
+        let mut data = self.tracking_data.lock().unwrap();
+        data.session_log = Some(SessionLog {
+            writer: LineWriter::new(file),
+            start: Instant::now(),
+            frames: 0,
+        });
+        Ok(())
+    }
+
+    pub fn recorded_frames(&self) -> usize {
+        let data = self.tracking_data.lock().unwrap();
+        data.session_log.as_ref().map_or(0, |log| log.frames)
+    }
+
+    pub fn is_connected(&self) -> bool {
+        self.tracking_data.lock().unwrap().connected
+    }
+
     fn connect(&mut self, headset_port: &str, tracking_port: &str) -> bool {
         // Open headset serial port (COM4)
         let headset_serial = match serialport::new(headset_port, 115200)
@@ -165,12 +318,30 @@ impl VRDevice {
                     Ok(0) => break,
                     Ok(_) => {
                         if let Ok(ir_data) = serde_json::from_str::<IRData>(line.trim()) {
-                            let mut data = tracking_data_tracking.lock().unwrap();
-                            data.ir_blobs = ir_data.ir.iter().map(|blob| IRBlob {
-                                x: blob.x,
-                                y: blob.y,
-                                size: blob.s,
-                            }).collect();
+                            let batch = {
+                                let mut data = tracking_data_tracking.lock().unwrap();
+                                data.ir_blobs = ir_data.ir.iter().map(|blob| IRBlob {
+                                    x: blob.x,
+                                    y: blob.y,
+                                    size: blob.s,
+                                }).collect();
+
+                                let data = &mut *data;
+                                if let Some(log) = data.session_log.as_mut() {
+                                    if let Err(e) = log.write(&data.quaternion, &data.ir_blobs) {
+                                        eprintln!("Session log error: {e}");
+                                        data.session_log = None;
+                                    }
+                                }
+
+                                data.queue_heading_frame()
+                            };
+
+                            // Estimate outside the lock so pose and position queries are not held up
+                            if let Some(batch) = batch {
+                                let heading = batch.estimate();
+                                tracking_data_tracking.lock().unwrap().apply_heading(&batch, heading);
+                            }
                         }
                     }
                     Err(e) => {
@@ -192,18 +363,22 @@ impl VRDevice {
     }
 
     // Calculate distance between two 2D points
-    fn calculate_pixel_distance(blob1: &IRBlob, blob2: &IRBlob) -> f64 {
-        let dx = (blob1.x as f64) - (blob2.x as f64);
-        let dy = (blob1.y as f64) - (blob2.y as f64);
+    fn calculate_pixel_distance(blob1: &(f64, f64), blob2: &(f64, f64)) -> f64 {
+        let dx = blob1.0 - blob2.0;
+        let dy = blob1.1 - blob2.1;
         (dx * dx + dy * dy).sqrt()
     }
 
     // Estimate Z-depth using perspective projection
-    fn estimate_depth(&self, ir_blobs: &[IRBlob]) -> Option<f64> {
+    fn estimate_depth(calibration: &Calibration, ir_blobs: &[(f64, f64)]) -> Option<f64> {
         if ir_blobs.len() < 2 {
             return None;
         }
 
+        // Average physical distance between LEDs (hand-tuned, scaled by the calibration if loaded)
+        let avg_led_spacing = calibration.average_led_spacing();
+        let focal_length = 0.5 * (calibration.camera.fx + calibration.camera.fy);
+
         // Calculate depth from ALL pairs of blobs and average
         let mut depth_sum = 0.0;
         let mut count = 0;
@@ -213,17 +388,11 @@ impl VRDevice {
         ir_blobs.iter().enumerate().for_each(|(next, blob_a)| {
             ir_blobs[next..].iter().for_each(|blob_b| {
                 let pixel_distance = Self::calculate_pixel_distance(blob_a, blob_b);
-                
-                // Average physical distance between LEDs (approximate)
-                // Real distances: 69mm, 97mm, 111mm, etc - average ~85mm
-                const AVG_LED_SPACING: f64 = 0.085;
 
-                const FOCAL_LENGTH: f64 = 1728.0;
-                
                 if pixel_distance >= 1.0 {
                     // Since the number of pixels is above 0, calculate and add the depth
 
-                    depth_sum += (AVG_LED_SPACING * FOCAL_LENGTH) / pixel_distance;
+                    depth_sum += (avg_led_spacing * focal_length) / pixel_distance;
                     count += 1;
                 }
             });
@@ -236,40 +405,45 @@ impl VRDevice {
         }
     }
 
-    // Estimate full 3D position from IR blobs
-    fn estimate_position(&self, ir_blobs: &[IRBlob]) -> Option<Vec3> {
+    // Estimate full 3D position from IR blobs, with the IMU heading relative to the calibration
+    fn estimate_position(calibration: &Calibration, heading: f64, ir_blobs: &[IRBlob]) -> Option<Vec3> {
         if ir_blobs.is_empty() {
             return None;
         }
 
+        let camera = &calibration.camera;
+
+        // Remove lens distortion before any geometry
+        let points: Vec<(f64, f64)> = ir_blobs.iter()
+            .map(|blob| camera.undistort_pixel(blob.x as f64, blob.y as f64))
+            .collect();
+
         // Calculate Z-depth first
-        let depth = self.estimate_depth(ir_blobs)?;
+        let depth = Self::estimate_depth(calibration, &points)?;
 
         // Calculate centroid
         let mut sum_x = 0.0;
         let mut sum_y = 0.0;
 
-        for blob in ir_blobs {
-            sum_x += blob.x as f64;
-            sum_y += blob.y as f64;
+        for point in &points {
+            sum_x += point.0;
+            sum_y += point.1;
         }
 
-        let centroid_x = sum_x / (ir_blobs.len() as f64);
-        let centroid_y = sum_y / (ir_blobs.len() as f64);
-
-        // Wiimote IR camera specs (33° horizontal FOV, 1024×768 output)
-        const CAMERA_CENTER_X: f64 = 512.0;
-        const CAMERA_CENTER_Y: f64 = 384.0;
-        const FOCAL_LENGTH: f64 = 1728.0;  // (1024/2) / tan(33°/2)
+        let centroid_x = sum_x / (points.len() as f64);
+        let centroid_y = sum_y / (points.len() as f64);
 
-        let offset_x = centroid_x - CAMERA_CENTER_X;
-        let offset_y = centroid_y - CAMERA_CENTER_Y;
+        let offset_x = centroid_x - camera.cx;
+        let offset_y = centroid_y - camera.cy;
 
-        // Convert pixel offset to real-world position
-        // Note: IR Sensor Y is inverted
-        let x = (offset_x * depth) / FOCAL_LENGTH;
-        let y = -(offset_y * depth) / FOCAL_LENGTH;
-        let z = -depth;
+        // Convert pixel offset to a position in the camera frame, then rotate into the IMU's world
+        // frame (the default mounting inverts Y and Z, matching the IR sensor layout)
+        let camera_position = [
+            (offset_x * depth) / camera.fx,
+            (offset_y * depth) / camera.fy,
+            depth,
+        ];
+        let [x, y, z] = calibration.camera_rotation(heading).conjugate().rotate(camera_position);
 
         // Write debug output to file
         if let Ok(mut file) = OpenOptions::new()
@@ -307,12 +481,36 @@ pub extern "C" fn vr_device_create(headset_port_name: *const c_char, tracking_po
         }
     };
 
-    let mut device = Box::new(VRDevice::new());
+    match VRDevice::open(headset_port, tracking_port) {
+        Some(device) => Box::into_raw(Box::new(device)),
+        None => std::ptr::null_mut(),
+    }
+}
 
-    if device.connect(headset_port, tracking_port) {
-        Box::into_raw(device)
-    } else {
-        std::ptr::null_mut()
+#[unsafe(no_mangle)]
+pub extern "C" fn vr_device_load_calibration(device: *mut VRDevice, path: *const c_char) -> u8 {
+    if device.is_null() || path.is_null() {
+        return 0;
+    }
+
+    let device = unsafe { &*device };
+    let path = match unsafe { CStr::from_ptr(path) }.to_str() {
+        Ok(s) => s,
+        Err(_) => return 0,
+    };
+
+    match Calibration::load(Path::new(path)) {
+        Ok(calibration) => {
+            println!("Loaded calibration: {path} (RMS {:.3}px), estimating IMU heading", calibration.rms_reprojection_error);
+            let mut data = device.tracking_data.lock().unwrap();
+            data.calibration = Arc::new(calibration);
+            data.heading = Some(HeadingTracker { heading: None, frames: Vec::new() });
+            1
+        }
+        Err(e) => {
+            eprintln!("{e}, using default calibration");
+            0
+        }
     }
 }
 
@@ -338,7 +536,7 @@ pub extern "C" fn vr_device_get_pose(device: *const VRDevice, out_quat: *mut Qua
     let out = unsafe { &mut *out_quat };
 
     let data = device.tracking_data.lock().unwrap();
-    *out = data.quaternion;
+    *out = data.quaternion.mul(&data.calibration.imu_to_constellation);
 }
 
 #[unsafe(no_mangle)]
@@ -352,8 +550,10 @@ pub extern "C" fn vr_device_get_position(device: *const VRDevice, out_pos: *mut
 
     let mut data = device.tracking_data.lock().unwrap();
 
-    // Estimate raw position from IR blobs
-    if let Some(raw_position) = device.estimate_position(&data.ir_blobs) {
+    // Estimate raw position from IR blobs, once the IMU heading is known
+    let raw_position = data.current_heading()
+        .and_then(|heading| VRDevice::estimate_position(&data.calibration, heading, &data.ir_blobs));
+    if let Some(raw_position) = raw_position {
         // Reject outliers (depth suddenly changed by more than 50cm)
         let depth_change = (raw_position.z - data.smoothed_position.z).abs();
         if depth_change > 0.5 && data.smoothed_position.z != 0.0 {
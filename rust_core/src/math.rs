@@ -0,0 +1,191 @@
+use crate::{Quaternion, Vec3};
+
+impl Quaternion {
+    pub const IDENTITY: Quaternion = Quaternion { w: 1.0, x: 0.0, y: 0.0, z: 0.0 };
+
+    // Hamilton product (self applied after rhs)
+    pub fn mul(&self, rhs: &Quaternion) -> Quaternion {
+        Quaternion {
+            w: self.w * rhs.w - self.x * rhs.x - self.y * rhs.y - self.z * rhs.z,
+            x: self.w * rhs.x + self.x * rhs.w + self.y * rhs.z - self.z * rhs.y,
+            y: self.w * rhs.y - self.x * rhs.z + self.y * rhs.w + self.z * rhs.x,
+            z: self.w * rhs.z + self.x * rhs.y - self.y * rhs.x + self.z * rhs.w,
+        }
+    }
+
+    pub fn conjugate(&self) -> Quaternion {
+        Quaternion { w: self.w, x: -self.x, y: -self.y, z: -self.z }
+    }
+
+    pub fn normalized(&self) -> Quaternion {
+        let norm = (self.w * self.w + self.x * self.x + self.y * self.y + self.z * self.z).sqrt();
+        if norm < 1e-12 {
+            return Quaternion::IDENTITY;
+        }
+        Quaternion { w: self.w / norm, x: self.x / norm, y: self.y / norm, z: self.z / norm }
+    }
+
+    // Rotation of `angle = |v|` radians about the axis `v / |v|`
+    pub fn from_rotation_vector(v: [f64; 3]) -> Quaternion {
+        let angle = (v[0] * v[0] + v[1] * v[1] + v[2] * v[2]).sqrt();
+        if angle < 1e-12 {
+            return Quaternion { w: 1.0, x: v[0] * 0.5, y: v[1] * 0.5, z: v[2] * 0.5 }.normalized();
+        }
+        let s = (angle * 0.5).sin() / angle;
+        Quaternion { w: (angle * 0.5).cos(), x: v[0] * s, y: v[1] * s, z: v[2] * s }
+    }
+
+    pub fn rotate(&self, v: [f64; 3]) -> [f64; 3] {
+        // v + 2w(q x v) + 2q x (q x v)
+        let q = [self.x, self.y, self.z];
+        let t = scale(cross(q, v), 2.0);
+        add(add(v, scale(t, self.w)), cross(q, t))
+    }
+}
+
+impl From<[f64; 3]> for Vec3 {
+    fn from(v: [f64; 3]) -> Self {
+        Vec3 { x: v[0], y: v[1], z: v[2] }
+    }
+}
+
+impl From<Vec3> for [f64; 3] {
+    fn from(v: Vec3) -> Self {
+        [v.x, v.y, v.z]
+    }
+}
+
+pub fn add(a: [f64; 3], b: [f64; 3]) -> [f64; 3] {
+    [a[0] + b[0], a[1] + b[1], a[2] + b[2]]
+}
+
+pub fn sub(a: [f64; 3], b: [f64; 3]) -> [f64; 3] {
+    [a[0] - b[0], a[1] - b[1], a[2] - b[2]]
+}
+
+pub fn scale(a: [f64; 3], s: f64) -> [f64; 3] {
+    [a[0] * s, a[1] * s, a[2] * s]
+}
+
+pub fn cross(a: [f64; 3], b: [f64; 3]) -> [f64; 3] {
+    [
+        a[1] * b[2] - a[2] * b[1],
+        a[2] * b[0] - a[0] * b[2],
+        a[0] * b[1] - a[1] * b[0],
+    ]
+}
+
+pub fn norm(a: [f64; 3]) -> f64 {
+    (a[0] * a[0] + a[1] * a[1] + a[2] * a[2]).sqrt()
+}
+
+pub fn invert_3x3(m: &[[f64; 3]; 3]) -> Option<[[f64; 3]; 3]> {
+    let c00 = m[1][1] * m[2][2] - m[1][2] * m[2][1];
+    let c01 = m[1][2] * m[2][0] - m[1][0] * m[2][2];
+    let c02 = m[1][0] * m[2][1] - m[1][1] * m[2][0];
+    let det = m[0][0] * c00 + m[0][1] * c01 + m[0][2] * c02;
+    if det.abs() < 1e-300 {
+        return None;
+    }
+    let inv_det = 1.0 / det;
+    Some([
+        [c00 * inv_det, (m[0][2] * m[2][1] - m[0][1] * m[2][2]) * inv_det, (m[0][1] * m[1][2] - m[0][2] * m[1][1]) * inv_det],
+        [c01 * inv_det, (m[0][0] * m[2][2] - m[0][2] * m[2][0]) * inv_det, (m[0][2] * m[1][0] - m[0][0] * m[1][2]) * inv_det],
+        [c02 * inv_det, (m[0][1] * m[2][0] - m[0][0] * m[2][1]) * inv_det, (m[0][0] * m[1][1] - m[0][1] * m[1][0]) * inv_det],
+    ])
+}
+
+// In-place Cholesky solve of the dense symmetric positive definite system `a * x = b`
+// (`a` is n x n row-major). Returns None if `a` is not positive definite.
+pub fn cholesky_solve(a: &mut [f64], b: &[f64]) -> Option<Vec<f64>> {
+    let n = b.len();
+    for j in 0..n {
+        let mut d = a[j * n + j];
+        for k in 0..j {
+            d -= a[j * n + k] * a[j * n + k];
+        }
+        if d <= 0.0 || !d.is_finite() {
+            return None;
+        }
+        let d = d.sqrt();
+        a[j * n + j] = d;
+        for i in (j + 1)..n {
+            let mut s = a[i * n + j];
+            for k in 0..j {
+                s -= a[i * n + k] * a[j * n + k];
+            }
+            a[i * n + j] = s / d;
+        }
+    }
+
+    let mut x = b.to_vec();
+    for i in 0..n {
+        for k in 0..i {
+            x[i] -= a[i * n + k] * x[k];
+        }
+        x[i] /= a[i * n + i];
+    }
+    for i in (0..n).rev() {
+        for k in (i + 1)..n {
+            x[i] -= a[k * n + i] * x[k];
+        }
+        x[i] /= a[i * n + i];
+    }
+    Some(x)
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn assert_close(a: f64, b: f64, tolerance: f64) {
+        assert!((a - b).abs() <= tolerance, "{a} != {b} (tolerance {tolerance})");
+    }
+
+    #[test]
+    fn cholesky_solves_spd_system() {
+        // a = l * l^T with l = [[2, 0, 0], [1, 3, 0], [-1, 2, 4]], x = [1, -2, 3]
+        let mut a = vec![4.0, 2.0, -2.0, 2.0, 10.0, 5.0, -2.0, 5.0, 21.0];
+        let b = [-6.0, -3.0, 51.0];
+        let x = cholesky_solve(&mut a, &b).unwrap();
+        for (xi, expected) in x.iter().zip([1.0, -2.0, 3.0]) {
+            assert_close(*xi, expected, 1e-12);
+        }
+    }
+
+    #[test]
+    fn cholesky_rejects_indefinite_matrix() {
+        let mut a = vec![1.0, 2.0, 2.0, 1.0];
+        assert!(cholesky_solve(&mut a, &[1.0, 1.0]).is_none());
+    }
+
+    #[test]
+    fn invert_3x3_gives_identity() {
+        let m = [[2.0, -1.0, 0.5], [0.3, 4.0, 1.0], [-2.0, 0.7, 3.0]];
+        let inv = invert_3x3(&m).unwrap();
+        for i in 0..3 {
+            for j in 0..3 {
+                let p: f64 = (0..3).map(|k| m[i][k] * inv[k][j]).sum();
+                assert_close(p, if i == j { 1.0 } else { 0.0 }, 1e-12);
+            }
+        }
+    }
+
+    #[test]
+    fn invert_3x3_rejects_singular_matrix() {
+        let m = [[1.0, 2.0, 3.0], [2.0, 4.0, 6.0], [0.0, 1.0, 1.0]];
+        assert!(invert_3x3(&m).is_none());
+    }
+
+    #[test]
+    fn rotation_vector_rotates_about_axis() {
+        let q = Quaternion::from_rotation_vector([0.0, 0.0, std::f64::consts::FRAC_PI_2]);
+        let v = q.rotate([1.0, 0.0, 0.0]);
+        assert_close(v[0], 0.0, 1e-12);
+        assert_close(v[1], 1.0, 1e-12);
+        assert_close(v[2], 0.0, 1e-12);
+
+        let back = q.conjugate().rotate(v);
+        assert_close(back[0], 1.0, 1e-12);
+    }
+}
@@ -25,6 +25,9 @@ typedef struct {
 VRDevice* vr_device_create(const char* headset_port_name, const char* tracking_port_name);
 void vr_device_destroy(VRDevice* device);
 
+// Load a calibration file written by the calibrate tool; returns 0 and keeps defaults on failure
+uint8_t vr_device_load_calibration(VRDevice* device, const char* path);
+
 uint8_t vr_device_update(VRDevice* device);
 void vr_device_get_pose(const VRDevice* device, Quaternion* out_quat);
 void vr_device_get_position(const VRDevice* device, Vec3* out_pos);